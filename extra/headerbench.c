@@ -0,0 +1,157 @@
+/*
+
+headerbench - micro benchmark for the reply header assembly of mrhttpd
+
+Builds the header of a typical 200 reply many times over, once the way
+mrhttpd 2.8.0 did it (null-separated string pool, recursive number
+formatting, final replacement pass) and once with the raw appending
+functions of mem.c. Prints the cost per header in nanoseconds.
+
+Build and run from the src directory:
+
+	make headerbench && ./headerbench
+
+*/
+
+#include "../src/mrhttpd.h"
+
+#define ROUNDS 10000000
+
+// The previous header builder, reproduced for comparison
+
+boolean legacyAdd(MemPool* mp, const char* string) {
+	int added = strlen(string) + 1;
+
+	if ((mp->current + added) >= mp->size)
+		return true;
+	memcpy(mp->mem + mp->current, string, added);
+	mp->current += added;
+	return false;
+}
+
+boolean legacyExtend(MemPool* mp, const char* string) {
+	int target = memPoolNextTarget(mp);
+	int added = strlen(string) + 1;
+
+	if ((target + added) >= mp->size)
+		return true;
+	memcpy(mp->mem + target, string, added);
+	mp->current = target + added;
+	return false;
+}
+
+boolean legacyExtendChar(MemPool* mp, const char c) {
+	int target = memPoolNextTarget(mp);
+
+	if ((target + 2) >= mp->size)
+		return true;
+	mp->mem[target++] = c;
+	mp->mem[target++] = '\0';
+	mp->current = target;
+	return false;
+}
+
+boolean legacyExtendNumber(MemPool* mp, const unsigned num) {
+	return num < 10 ? legacyExtendChar(mp, digit[num]) : (legacyExtendNumber(mp, num / 10 ) || legacyExtendChar(mp, digit[num % 10]));
+}
+
+boolean legacyStringAdd(StringPool* sp, const char* string) {
+	int target;
+
+	if (sp->current >= sp->size)
+		return true;
+	target = sp->mp->current;
+	if (legacyAdd(sp->mp, string))
+		return true;
+	sp->strings[sp->current++] = sp->mp->mem + target;
+	return false;
+}
+
+void legacyReplace(MemPool* mp, const char from, const char to) {
+	char* cp;
+	int i;
+
+	for (cp = mp->mem, i = mp->current; i > 0; cp++, i--)
+		if (*cp == from)
+		  *cp = to;
+}
+
+int legacyBuild(MemPool* mp, StringPool* sp, const char* protocol, const unsigned contentLength, const char* contentType) {
+	sp->current = 0;
+	mp->current = 0;
+	if (
+		legacyStringAdd(sp, protocol) ||
+		legacyExtendChar(mp, ' ') ||
+		legacyExtend(mp, "200 OK\r") ||
+		legacyAdd(mp, "Server: " SERVER_SOFTWARE "\r") ||
+		legacyAdd(mp, "Content-Length: ") ||
+		legacyExtendNumber(mp, contentLength) ||
+		legacyExtendChar(mp, '\r') ||
+		legacyAdd(mp, "Content-Type: ") ||
+		legacyExtend(mp, contentType) ||
+		legacyExtendChar(mp, '\r') ||
+		legacyStringAdd(sp, "Connection: keep-alive\r") ||
+		legacyStringAdd(sp, "\r")
+	)
+		return -1;
+	legacyReplace(mp, '\0', '\n');
+	return mp->current;
+}
+
+// The current header builder, as used by httpRequest()
+
+int currentBuild(MemPool* mp, const char* protocol, const unsigned contentLength, const char* contentType) {
+	memPoolReset(mp);
+	if (
+		memPoolAppend(mp, protocol, strlen(protocol)) ||
+		memPoolAppendLiteral(mp, " 200 OK\r\n") ||
+		memPoolAppendLiteral(mp, "Server: " SERVER_SOFTWARE "\r\nContent-Length: ") ||
+		memPoolAppendNumber(mp, contentLength) ||
+		memPoolAppendLiteral(mp, "\r\nContent-Type: ") ||
+		memPoolAppend(mp, contentType, strlen(contentType)) ||
+		memPoolAppendLiteral(mp, "\r\n") ||
+		memPoolAppendLiteral(mp, "Connection: keep-alive\r\n") ||
+		memPoolAppendLiteral(mp, "\r\n")
+	)
+		return -1;
+	return mp->current;
+}
+
+double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void) {
+	char legacyBuf[512], currentBuf[512];
+	MemPool legacyMemPool = { sizeof(legacyBuf), 0, legacyBuf };
+	char* legacyHeader[16];
+	StringPool legacyPool = { sizeof(legacyHeader), 0, legacyHeader, &legacyMemPool };
+	MemPool currentMemPool = { sizeof(currentBuf), 0, currentBuf };
+	volatile unsigned contentLength = 1234567;
+	volatile long sum = 0;
+	double start, legacy, current;
+	int i;
+
+	start = now();
+	for (i = 0; i < ROUNDS; i++)
+		sum += legacyBuild(&legacyMemPool, &legacyPool, PROTOCOL_HTTP_1_1, contentLength + (i & 1023), "text/html");
+	legacy = (now() - start) / ROUNDS;
+
+	start = now();
+	for (i = 0; i < ROUNDS; i++)
+		sum += currentBuild(&currentMemPool, PROTOCOL_HTTP_1_1, contentLength + (i & 1023), "text/html");
+	current = (now() - start) / ROUNDS;
+
+	if (legacyBuild(&legacyMemPool, &legacyPool, PROTOCOL_HTTP_1_1, 42, "text/html") != currentBuild(&currentMemPool, PROTOCOL_HTTP_1_1, 42, "text/html") ||
+		memcmp(legacyBuf, currentBuf, currentMemPool.current)) {
+		puts("headerbench: the two builders disagree");
+		return 1;
+	}
+
+	printf("legacy header builder:  %6.1f ns per header\n", legacy);
+	printf("current header builder: %6.1f ns per header\n", current);
+	return 0;
+}
@@ -0,0 +1,986 @@
+/*
+
+httpbench - load generator and benchmark suite for mrhttpd
+
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+Runs a fixed matrix of load scenarios against a running server and writes
+one CSV line per scenario, in the format of httpd_benchmark.csv. Latency
+percentiles go to the Remark column, and a summary goes to stderr.
+
+Build and run from the top directory, with mrhttpd running:
+
+	make bench
+
+or from the src directory:
+
+	make httpbench && ./httpbench [options] [port [host]]
+
+Options:
+
+	-q       quick run: a hundredth of the requests, concurrency up to 1000
+	-t name  run the scenarios of that name only
+	-o file  write the CSV to a file instead of stdout
+	-s path  static file, default /perftest.html
+	-g path  CGI program, default CGI_PATH/perftest.sh
+	-u path  directory for PUT requests, default PUT_PATH
+	-l path  large file; by default one is uploaded to the PUT directory
+
+The port defaults to SERVER_PORT, the host to 127.0.0.1. Scenarios the
+server is not configured for are reported as skipped. No root privileges
+are needed: the limit of open files is raised up to the hard limit, and
+concurrency levels beyond that are skipped, too.
+
+*/
+
+#define _GNU_SOURCE
+
+#include "../src/config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define null ((void*) 0L)
+
+#define BENCH_TIMEOUT 10          // seconds without progress before a connection fails
+#define BENCH_PIPELINE 16         // requests per batch in the pipelining scenario
+#define BENCH_BODY 1049           // size of a PUT body, same as perftest.html
+#define BENCH_LARGE 8388608       // size of the uploaded large file
+#define BENCH_DESCRIPTORS 64      // reserve of file descriptors for other purposes
+#define CSV_COLUMNS 43
+
+typedef enum { false, true } boolean;
+
+typedef enum { KIND_STATIC, KIND_CGI, KIND_RANGE, KIND_NOT_MODIFIED, KIND_LARGE, KIND_PIPELINE, KIND_PUT } Kind;
+
+typedef struct {
+	const char* name;
+	Kind kind;
+	int number;
+	int concurrency;
+	boolean keepAlive;
+} Scenario;
+
+// The matrix of perftest.pl, followed by the scenarios it did not cover
+
+const Scenario scenario[] = {
+	{ "cgi",      KIND_CGI,          10000,   1,     false },
+	{ "cgi",      KIND_CGI,          10000,   10,    false },
+	{ "cgi",      KIND_CGI,          10000,   100,   false },
+	{ "cgi",      KIND_CGI,          10000,   1000,  false },
+	{ "static",   KIND_STATIC,       1000000, 1,     true },
+	{ "static",   KIND_STATIC,       1000000, 10,    true },
+	{ "static",   KIND_STATIC,       1000000, 100,   true },
+	{ "static",   KIND_STATIC,       1000000, 1000,  true },
+	{ "static",   KIND_STATIC,       1000000, 10000, true },
+	{ "static",   KIND_STATIC,       1000000, 20000, true },
+	{ "static",   KIND_STATIC,       1000000, 1,     false },
+	{ "static",   KIND_STATIC,       1000000, 10,    false },
+	{ "static",   KIND_STATIC,       1000000, 100,   false },
+	{ "static",   KIND_STATIC,       1000000, 1000,  false },
+	{ "static",   KIND_STATIC,       1000000, 10000, false },
+	{ "static",   KIND_STATIC,       1000000, 20000, false },
+	{ "range",    KIND_RANGE,        100000,  1,     true },
+	{ "range",    KIND_RANGE,        100000,  100,   true },
+	{ "304",      KIND_NOT_MODIFIED, 100000,  1,     true },
+	{ "304",      KIND_NOT_MODIFIED, 100000,  100,   true },
+	{ "large",    KIND_LARGE,        1000,    1,     true },
+	{ "large",    KIND_LARGE,        1000,    10,    true },
+	{ "pipeline", KIND_PIPELINE,     1000000, 1,     true },
+	{ "pipeline", KIND_PIPELINE,     1000000, 100,   true },
+	{ "put",      KIND_PUT,          10000,   1,     true },
+	{ "put",      KIND_PUT,          10000,   10,    true }
+};
+
+#define SCENARIOS (sizeof(scenario) / sizeof(scenario[0]))
+
+// Settings
+
+const char* host = "127.0.0.1";
+const char* port = SERVER_PORT_STR;
+const char* staticPath = "/perftest.html";
+#ifdef CGI_PATH
+const char* cgiPath = CGI_PATH "/perftest.sh";
+#else
+const char* cgiPath = null;
+#endif
+#ifdef PUT_PATH
+const char* putPath = PUT_PATH;
+#else
+const char* putPath = null;
+#endif
+const char* largePath = null;
+boolean largeUploaded = false;
+struct sockaddr_storage address;
+socklen_t addressLength;
+int maxConcurrency;
+
+// One benchmark run, i.e. one line of the CSV file
+
+typedef struct {
+	uint32_t connect;         // microseconds
+	uint32_t wait;
+	uint32_t total;
+} Sample;
+
+typedef struct {
+	const Scenario* scenario;
+	int number;
+	int concurrency;
+	int pipeline;
+	const char* path;
+	char request[1024];       // shared by all connections, except for PUT requests
+	int requestLength;
+	int expected;             // status code of a successful reply
+
+	int issued;               // requests handed out to connections
+	int recorded;
+	Sample* sample;
+
+	int failed;
+	int writeErrors;
+	int unexpected;
+	int keepAlive;
+	uint64_t totalBytes;
+	uint64_t bodyBytes;
+} Run;
+
+Run run;
+
+typedef enum { PHASE_HEADER, PHASE_BODY, PHASE_CHUNK_SIZE, PHASE_CHUNK_DATA, PHASE_TRAILER, PHASE_UNTIL_EOF } Phase;
+
+typedef struct {
+	int fd;
+	int id;
+	boolean connecting;
+	char* request;            // batch of pipelined requests
+	int requestLength;        // of a single request
+	int batchLength;          // of the batch being sent
+	int sendOffset;
+	int outstanding;          // replies still due
+	boolean reused;
+	int64_t connectStart;
+	int64_t connected;
+	int64_t sentAt;
+	int64_t firstByte;
+	int64_t activity;
+
+	// reply parser
+	Phase phase;
+	char header[4096];
+	int headerLength;
+	int64_t remaining;
+	int status;
+	boolean close;
+	int lineLength;
+} Connection;
+
+typedef struct {
+	int first;                // id of the first connection of the worker
+	int count;
+	int epollFd;
+	Connection* connection;
+	char* batch;              // the shared request, repeated for pipelining
+	int failed;
+	int writeErrors;
+	int unexpected;
+	int keepAlive;
+	uint64_t totalBytes;
+	uint64_t bodyBytes;
+} Worker;
+
+int64_t now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Hand out up to count requests of the run, returns the number granted
+
+int claim(const int count) {
+	int issued = __atomic_fetch_add(&run.issued, count, __ATOMIC_RELAXED);
+
+	if (issued >= run.number)
+		return 0;
+	return issued + count > run.number ? run.number - issued : count;
+}
+
+void record(const int64_t start, const int64_t connect, const int64_t firstByte, const int64_t end) {
+	int index = __atomic_fetch_add(&run.recorded, 1, __ATOMIC_RELAXED);
+	Sample* sample;
+
+	if (index >= run.number)
+		return;
+	sample = &run.sample[index];
+	sample->connect = connect / 1000;
+	sample->wait = (firstByte - start) / 1000;
+	sample->total = (end - start) / 1000;
+}
+
+// Simple blocking request, used to probe the server before a run
+
+typedef struct {
+	int status;
+	char server[64];
+	char etag[64];
+	long length;              // of the body
+} Probe;
+
+void headerValue(const char* header, const char* name, char* value, const int size) {
+	const char* line;
+	int length = strlen(name), i;
+
+	value[0] = '\0';
+	for (line = header; line != null; line = strchr(line, '\n'), line = line == null ? null : line + 1)
+		if (!strncasecmp(line, name, length) && line[length] == ':') {
+			line += length + 1;
+			while (*line == ' ')
+				line++;
+			for (i = 0; i < size - 1 && line[i] != '\r' && line[i] != '\n' && line[i] != '\0'; i++)
+				value[i] = line[i];
+			value[i] = '\0';
+			return;
+		}
+}
+
+// The end of a header, i.e. of its empty line. CGI programs may end lines with LF only.
+
+char* headerEnd(const char* header) {
+	const char* lf;
+
+	for (lf = strchr(header, '\n'); lf != null; lf = strchr(lf + 1, '\n'))
+		if (lf[1] == '\n')
+			return (char*) lf + 2;
+		else if (lf[1] == '\r' && lf[2] == '\n')
+			return (char*) lf + 3;
+	return null;
+}
+
+boolean sendAll(const int fd, const char* buf, int length) {
+	ssize_t count;
+
+	for (; length > 0; buf += count, length -= count)
+		if ((count = send(fd, buf, length, MSG_NOSIGNAL)) <= 0)
+			return true;
+	return false;
+}
+
+boolean probe(const char* request, const int requestLength, Probe* result) {
+	char buf[65536];
+	char* end = null;
+	int fd, length = 0;
+	ssize_t count;
+
+	memset(result, 0, sizeof(*result));
+	fd = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return true;
+	if (connect(fd, (struct sockaddr*) &address, addressLength) || sendAll(fd, request, requestLength)) {
+		close(fd);
+		return true;
+	}
+	while (end == null && length < sizeof(buf) - 1 && (count = recv(fd, buf + length, sizeof(buf) - 1 - length, 0)) > 0) {
+		length += count;
+		buf[length] = '\0';
+		end = headerEnd(buf);
+	}
+	if (end == null) {
+		close(fd);
+		return true;
+	}
+	result->length = length - (end - buf);
+	end[-1] = '\0';
+	sscanf(buf, "%*s %d", &result->status);
+	headerValue(buf, "Server", result->server, sizeof(result->server));
+	headerValue(buf, "ETag", result->etag, sizeof(result->etag));
+	// the request asked the server to close the connection after the body
+	while ((count = recv(fd, buf, sizeof(buf), 0)) > 0)
+		result->length += count;
+	close(fd);
+	return result->status == 0;
+}
+
+int buildRequest(char* buf, const int size, const char* method, const char* path, const char* extra, const boolean keepAlive, const long bodyLength) {
+	char length[48] = "";
+
+	if (bodyLength >= 0)
+		snprintf(length, sizeof(length), "Content-Length: %ld\r\n", bodyLength);
+	return snprintf(buf, size, "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: httpbench\r\n%s%s%s\r\n",
+		method, path, host, extra, length, keepAlive ? "" : "Connection: close\r\n");
+}
+
+// Upload a large file to the PUT directory, for the large file scenario
+
+boolean uploadLargeFile(void) {
+	static char path[256];
+	char header[512];
+	char* body;
+	Probe result;
+	int headerLength;
+	boolean error;
+
+	if (putPath == null)
+		return true;
+	snprintf(path, sizeof(path), "%s/httpbench-large.bin", putPath);
+	headerLength = buildRequest(header, sizeof(header), "PUT", path, "", false, BENCH_LARGE);
+	body = (char*) malloc(headerLength + BENCH_LARGE);
+	if (body == null)
+		return true;
+	memcpy(body, header, headerLength);
+	for (int i = 0; i < BENCH_LARGE; i++)
+		body[headerLength + i] = 'a' + i % 26;
+	error = probe(body, headerLength + BENCH_LARGE, &result) || result.status / 100 != 2;
+	free(body);
+	if (!error) {
+		largePath = path;
+		largeUploaded = true;
+	}
+	return error;
+}
+
+void removeFile(const char* path) {
+	char request[512];
+	Probe result;
+
+	probe(request, buildRequest(request, sizeof(request), "DELETE", path, "", false, -1), &result);
+}
+
+// Connections
+
+void connectionClose(Worker* worker, Connection* c) {
+	if (c->fd >= 0) {
+		epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, c->fd, null);
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+void connectionWatch(Worker* worker, Connection* c, const int op, const uint32_t events) {
+	struct epoll_event event;
+
+	event.events = events;
+	event.data.ptr = c;
+	epoll_ctl(worker->epollFd, op, c->fd, &event);
+}
+
+void replyReset(Connection* c) {
+	c->phase = PHASE_HEADER;
+	c->headerLength = 0;
+	c->firstByte = 0;
+}
+
+// Send a batch of requests on an open connection. Returns false if there are no requests left.
+
+boolean connectionBatch(Worker* worker, Connection* c) {
+	int count = claim(run.pipeline);
+
+	if (count == 0)
+		return false;
+	c->outstanding = count;
+	c->batchLength = count * c->requestLength;
+	c->sendOffset = 0;
+	c->sentAt = now();
+	c->activity = c->sentAt;
+	replyReset(c);
+	connectionWatch(worker, c, EPOLL_CTL_MOD, EPOLLOUT);
+	return true;
+}
+
+// Open a new connection and send the first batch. Returns false if there are no requests left.
+
+boolean connectionOpen(Worker* worker, Connection* c) {
+	int count = claim(run.pipeline);
+	int one = 1;
+
+	if (count == 0)
+		return false;
+	c->outstanding = count;
+	c->batchLength = count * c->requestLength;
+	c->sendOffset = 0;
+	c->reused = false;
+	c->connectStart = now();
+	c->activity = c->connectStart;
+	replyReset(c);
+	c->fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd < 0) {
+		worker->failed += count;
+		return true;
+	}
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, (struct sockaddr*) &address, addressLength) && errno != EINPROGRESS) {
+		close(c->fd);
+		c->fd = -1;
+		worker->failed += count;
+		return true;
+	}
+	c->connecting = true;
+	connectionWatch(worker, c, EPOLL_CTL_ADD, EPOLLOUT);
+	return true;
+}
+
+// A connection is done, failed or closed by the server: open the next one if requests are left.
+// Returns false if the connection is retired.
+
+boolean connectionNext(Worker* worker, Connection* c) {
+	connectionClose(worker, c);
+	while (connectionOpen(worker, c))
+		if (c->fd >= 0)
+			return true;
+	return false;
+}
+
+void connectionFail(Worker* worker, Connection* c) {
+	worker->failed += c->outstanding;
+	c->outstanding = 0;
+}
+
+// A reply is complete
+
+void replyDone(Worker* worker, Connection* c, const int64_t end) {
+	const boolean first = !c->reused && c->outstanding == c->batchLength / c->requestLength;
+	const int64_t start = first ? c->connectStart : c->sentAt;
+
+	record(start, first ? c->connected - c->connectStart : 0, c->firstByte, end);
+	if (c->status != run.expected)
+		worker->unexpected++;
+	if (run.scenario->keepAlive && !c->close)
+		worker->keepAlive++;
+	c->outstanding--;
+	replyReset(c);
+}
+
+// Parse received data. Returns true on a protocol error.
+
+boolean replyParse(Worker* worker, Connection* c, const char* data, int length, const int64_t received) {
+	char value[64];
+	char* end;
+	int count;
+
+	while (length > 0 && c->outstanding > 0) {
+		if (c->firstByte == 0)
+			c->firstByte = received;
+		switch (c->phase) {
+		case PHASE_HEADER:
+			count = sizeof(c->header) - 1 - c->headerLength;
+			if (count == 0)
+				return true; // header too large
+			if (count > length)
+				count = length;
+			memcpy(c->header + c->headerLength, data, count);
+			c->header[c->headerLength + count] = '\0';
+			end = headerEnd(c->header + (c->headerLength > 2 ? c->headerLength - 2 : 0));
+			if (end == null) {
+				c->headerLength += count;
+				data += count;
+				length -= count;
+				break;
+			}
+			count = end - (c->header + c->headerLength); // header bytes in this block
+			data += count;
+			length -= count;
+			end[-1] = '\0';
+			c->status = 0;
+			sscanf(c->header, "%*s %d", &c->status);
+			headerValue(c->header, "Connection", value, sizeof(value));
+			c->close = !strcasecmp(value, "close");
+			headerValue(c->header, "Transfer-Encoding", value, sizeof(value));
+			if (c->status == 304 || c->status == 204) {
+				replyDone(worker, c, received);
+				break;
+			}
+			if (!strcasecmp(value, "chunked")) {
+				c->phase = PHASE_CHUNK_SIZE;
+				c->remaining = 0;
+				break;
+			}
+			headerValue(c->header, "Content-Length", value, sizeof(value));
+			if (value[0] == '\0') {
+				c->phase = PHASE_UNTIL_EOF;
+				break;
+			}
+			c->remaining = atoll(value);
+			c->phase = PHASE_BODY;
+			if (c->remaining == 0)
+				replyDone(worker, c, received);
+			break;
+		case PHASE_BODY:
+		case PHASE_CHUNK_DATA:
+			count = c->remaining < length ? c->remaining : length;
+			worker->bodyBytes += count;
+			c->remaining -= count;
+			data += count;
+			length -= count;
+			if (c->remaining > 0)
+				break;
+			if (c->phase == PHASE_BODY)
+				replyDone(worker, c, received);
+			else {
+				c->phase = PHASE_CHUNK_SIZE; // the line break after the data counts as an empty line
+				c->remaining = 0;
+			}
+			break;
+		case PHASE_CHUNK_SIZE:
+			// hexadecimal size, possibly preceded by the line break of the previous chunk
+			for (; length > 0 && *data != '\n'; data++, length--)
+				if (isxdigit((unsigned char) *data) && c->lineLength >= 0)
+					c->remaining = c->remaining * 16 + (isdigit((unsigned char) *data) ? *data - '0' : (*data | 0x20) - 'a' + 10), c->lineLength++;
+				else if (*data != '\r' && c->lineLength > 0)
+					c->lineLength = -1; // chunk extension
+			if (length == 0)
+				break;
+			data++;
+			length--;
+			if (c->lineLength == 0)
+				break; // line break after chunk data
+			c->lineLength = 0;
+			c->phase = c->remaining == 0 ? PHASE_TRAILER : PHASE_CHUNK_DATA;
+			break;
+		case PHASE_TRAILER:
+			for (; length > 0 && *data != '\n'; data++, length--)
+				if (*data != '\r')
+					c->lineLength++;
+			if (length == 0)
+				break;
+			data++;
+			length--;
+			if (c->lineLength == 0)
+				replyDone(worker, c, received);
+			c->lineLength = 0;
+			break;
+		case PHASE_UNTIL_EOF:
+			worker->bodyBytes += length;
+			length = 0;
+			break;
+		}
+	}
+	return false;
+}
+
+void connectionEvent(Worker* worker, Connection* c, const uint32_t events, char* buf, const int size) {
+	ssize_t count;
+	int64_t t;
+	int error = 0;
+	socklen_t errorLength = sizeof(error);
+
+	if (c->connecting) {
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &errorLength);
+		if (error) {
+			connectionFail(worker, c);
+			connectionNext(worker, c);
+			return;
+		}
+		c->connecting = false;
+		c->connected = now();
+		c->sentAt = c->connected;
+	}
+
+	if (c->sendOffset < c->batchLength) {
+		count = send(c->fd, c->request + c->sendOffset, c->batchLength - c->sendOffset, MSG_NOSIGNAL);
+		if (count < 0 && errno != EAGAIN) {
+			worker->writeErrors++;
+			connectionFail(worker, c);
+			connectionNext(worker, c);
+			return;
+		}
+		if (count > 0) {
+			c->sendOffset += count;
+			c->activity = now();
+		}
+		if (c->sendOffset == c->batchLength)
+			connectionWatch(worker, c, EPOLL_CTL_MOD, EPOLLIN);
+		return;
+	}
+
+	for (;;) {
+		count = recv(c->fd, buf, size, 0);
+		if (count < 0 && errno == EAGAIN)
+			return;
+		t = now();
+		c->activity = t;
+		if (count <= 0) {
+			// closed by the server: the end of a reply without length, or a failure
+			if (c->phase == PHASE_UNTIL_EOF && c->outstanding > 0)
+				replyDone(worker, c, t);
+			connectionFail(worker, c);
+			connectionNext(worker, c);
+			return;
+		}
+		worker->totalBytes += count;
+		if (replyParse(worker, c, buf, count, t)) {
+			connectionFail(worker, c);
+			connectionNext(worker, c);
+			return;
+		}
+		if (c->outstanding == 0) {
+			if (!run.scenario->keepAlive || c->close)
+				connectionNext(worker, c);
+			else {
+				c->reused = true;
+				if (!connectionBatch(worker, c))
+					connectionClose(worker, c); // all requests handed out
+			}
+			return;
+		}
+	}
+}
+
+void* workerThread(void* arg) {
+	Worker* worker = (Worker*) arg;
+	struct epoll_event event[256];
+	char buf[65536];
+	int64_t lastSweep = now(), t;
+	int active = 0, count, i;
+
+	worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	for (i = 0; i < worker->count; i++) {
+		Connection* c = &worker->connection[i];
+		c->fd = -1;
+		c->id = worker->first + i;
+		if (run.scenario->kind == KIND_PUT) {
+			// every connection uploads a file of its own
+			char path[256];
+			char* request = (char*) malloc(1024 + BENCH_BODY);
+			snprintf(path, sizeof(path), "%s/httpbench-%d.txt", putPath, c->id);
+			c->requestLength = buildRequest(request, 1024, "PUT", path, "", true, BENCH_BODY);
+			memset(request + c->requestLength, 'x', BENCH_BODY);
+			c->requestLength += BENCH_BODY;
+			c->request = request;
+		} else {
+			c->request = worker->batch;
+			c->requestLength = run.requestLength;
+		}
+		if (connectionNext(worker, c))
+			active++;
+	}
+
+	while (active > 0) {
+		count = epoll_wait(worker->epollFd, event, 256, 1000);
+		for (i = 0; i < count; i++) {
+			Connection* c = (Connection*) event[i].data.ptr;
+			connectionEvent(worker, c, event[i].events, buf, sizeof(buf));
+		}
+		t = now();
+		if (t - lastSweep > 1000000000) {
+			lastSweep = t;
+			for (i = 0; i < worker->count; i++) {
+				Connection* c = &worker->connection[i];
+				if (c->fd >= 0 && t - c->activity > (int64_t) BENCH_TIMEOUT * 1000000000) {
+					connectionFail(worker, c);
+					connectionNext(worker, c);
+				}
+			}
+		}
+		for (active = 0, i = 0; i < worker->count; i++)
+			if (worker->connection[i].fd >= 0)
+				active++;
+	}
+
+	if (run.scenario->kind == KIND_PUT)
+		for (i = 0; i < worker->count; i++)
+			free(worker->connection[i].request);
+	close(worker->epollFd);
+	return null;
+}
+
+// Statistics
+
+typedef enum { FIELD_CONNECT, FIELD_PROCESSING, FIELD_WAIT, FIELD_TOTAL, FIELDS } Field;
+
+typedef struct {
+	double min, mean, sd, median, max, p99, p999;
+} Stats;
+
+int compare(const void* a, const void* b) {
+	return *(const uint32_t*) a < *(const uint32_t*) b ? -1 : *(const uint32_t*) a > *(const uint32_t*) b;
+}
+
+void stats(const int count, const Field field, Stats* s) {
+	uint32_t* value = (uint32_t*) malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+	double sum = 0, square = 0;
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	if (value == null || count == 0) {
+		free(value);
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		const Sample* sample = &run.sample[i];
+		value[i] = field == FIELD_CONNECT ? sample->connect : field == FIELD_PROCESSING ? sample->total - sample->connect :
+			field == FIELD_WAIT ? sample->wait : sample->total;
+		sum += value[i];
+	}
+	qsort(value, count, sizeof(uint32_t), compare);
+	s->mean = sum / count;
+	for (i = 0; i < count; i++)
+		square += (value[i] - s->mean) * (value[i] - s->mean);
+	// in milliseconds, as ab does
+	s->sd = sqrt(square / count) / 1000;
+	s->mean /= 1000;
+	s->min = value[0] / 1000.0;
+	s->max = value[count - 1] / 1000.0;
+	s->median = value[count / 2] / 1000.0;
+	s->p99 = value[(int) (count * 0.99)] / 1000.0;
+	s->p999 = value[(int) (count * 0.999)] / 1000.0;
+	free(value);
+}
+
+// Run one scenario and write its CSV line
+
+void benchmark(FILE* csv, const char* kernel, const Scenario* sc, const int number, const int concurrency) {
+	char extra[128] = "";
+	char skip[128] = "";
+	Probe result;
+	pthread_t* thread = null;
+	Worker* worker = null;
+	int threads, i, count;
+	int64_t start, elapsed;
+
+	memset(&run, 0, sizeof(run));
+	run.scenario = sc;
+	run.number = number;
+	run.concurrency = concurrency;
+	run.pipeline = sc->kind == KIND_PIPELINE ? BENCH_PIPELINE : 1;
+
+	switch (sc->kind) {
+	case KIND_CGI:
+		run.path = cgiPath;
+		break;
+	case KIND_LARGE:
+		if (largePath == null && uploadLargeFile())
+			snprintf(skip, sizeof(skip), "skipped: no large file");
+		run.path = largePath;
+		break;
+	case KIND_PUT:
+		run.path = putPath;
+		break;
+	default:
+		run.path = staticPath;
+	}
+	if (run.path == null && skip[0] == '\0')
+		snprintf(skip, sizeof(skip), "skipped: not configured");
+	if (concurrency > maxConcurrency && skip[0] == '\0')
+		snprintf(skip, sizeof(skip), "skipped: needs %d file descriptors", concurrency + BENCH_DESCRIPTORS);
+
+	if (skip[0] == '\0') {
+		if (sc->kind == KIND_RANGE)
+			snprintf(extra, sizeof(extra), "Range: bytes=100-199\r\n");
+		if (sc->kind == KIND_NOT_MODIFIED) {
+			run.requestLength = buildRequest(run.request, sizeof(run.request), "GET", run.path, "", false, -1);
+			if (probe(run.request, run.requestLength, &result) || result.etag[0] == '\0')
+				snprintf(skip, sizeof(skip), "skipped: no ETag");
+			else
+				snprintf(extra, sizeof(extra), "If-None-Match: %s\r\n", result.etag);
+		}
+	}
+	if (skip[0] == '\0') {
+		// probe with a request of the scenario, for the reference status, server and length
+		if (sc->kind == KIND_PUT) {
+			char path[256];
+			char* request = (char*) malloc(1024 + BENCH_BODY);
+			snprintf(path, sizeof(path), "%s/httpbench-0.txt", putPath);
+			count = buildRequest(request, 1024, "PUT", path, "", false, BENCH_BODY);
+			memset(request + count, 'x', BENCH_BODY);
+			if (probe(request, count + BENCH_BODY, &result) || result.status / 100 != 2)
+				snprintf(skip, sizeof(skip), "skipped: PUT status %d", result.status);
+			free(request);
+		} else {
+			run.requestLength = buildRequest(run.request, sizeof(run.request), "GET", run.path, extra, false, -1);
+			if (probe(run.request, run.requestLength, &result) || (result.status / 100 != 2 && result.status != 304))
+				snprintf(skip, sizeof(skip), "skipped: status %d", result.status);
+			run.requestLength = buildRequest(run.request, sizeof(run.request), "GET", run.path, extra, sc->keepAlive, -1);
+		}
+		run.expected = result.status;
+	}
+	if (skip[0] != '\0') {
+		fprintf(csv, "%s, %d, %d, %s, ", kernel, number, concurrency, sc->keepAlive ? "yes" : "no");
+		for (i = 4; i < CSV_COLUMNS - 1; i++)
+			fputs(", ", csv);
+		fprintf(csv, "%s %s\n", sc->name, skip);
+		fprintf(stderr, "%-8s  c=%-5d  %-3s  %s\n", sc->name, concurrency, sc->keepAlive ? "ka" : "", skip);
+		return;
+	}
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+	if (threads > concurrency)
+		threads = concurrency;
+	run.sample = (Sample*) malloc(number * sizeof(Sample));
+	thread = (pthread_t*) calloc(threads, sizeof(pthread_t));
+	worker = (Worker*) calloc(threads, sizeof(Worker));
+	if (run.sample == null || thread == null || worker == null) {
+		fputs("httpbench: out of memory\n", stderr);
+		exit(1);
+	}
+
+	start = now();
+	for (i = 0; i < threads; i++) {
+		worker[i].first = (int) ((long) concurrency * i / threads);
+		worker[i].count = (int) ((long) concurrency * (i + 1) / threads) - worker[i].first;
+		worker[i].connection = (Connection*) calloc(worker[i].count, sizeof(Connection));
+		worker[i].batch = (char*) malloc(BENCH_PIPELINE * run.requestLength);
+		for (count = 0; count < run.pipeline; count++)
+			memcpy(worker[i].batch + count * run.requestLength, run.request, run.requestLength);
+		pthread_create(&thread[i], null, workerThread, &worker[i]);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(thread[i], null);
+		run.failed += worker[i].failed;
+		run.writeErrors += worker[i].writeErrors;
+		run.unexpected += worker[i].unexpected;
+		run.keepAlive += worker[i].keepAlive;
+		run.totalBytes += worker[i].totalBytes;
+		run.bodyBytes += worker[i].bodyBytes;
+		free(worker[i].connection);
+		free(worker[i].batch);
+	}
+	elapsed = now() - start;
+
+	if (sc->kind == KIND_PUT)
+		for (i = 0; i < concurrency; i++) {
+			char path[256];
+			snprintf(path, sizeof(path), "%s/httpbench-%d.txt", putPath, i);
+			removeFile(path);
+		}
+
+	// the columns of ab, as collected by perftest.pl
+	double seconds = elapsed / 1e9;
+	int completed = run.recorded < number ? run.recorded : number;
+	Stats s[FIELDS];
+	for (i = 0; i < FIELDS; i++)
+		stats(completed, i, &s[i]);
+
+	fprintf(csv, "%s, %d, %d, %s, %s, %s, %s, %s, %ld, %d, %.3f, %d, %d, %d, ",
+		kernel, number, concurrency, sc->keepAlive ? "yes" : "no", result.server, host, port, run.path, result.length,
+		concurrency, seconds, completed, run.failed, run.writeErrors);
+	if (run.unexpected > 0)
+		fprintf(csv, "%d, ", run.unexpected);
+	else
+		fputs(", ", csv);
+	if (sc->keepAlive)
+		fprintf(csv, "%d, ", run.keepAlive);
+	else
+		fputs(", ", csv);
+	fprintf(csv, "%llu, %llu, %.2f, %.3f, %.3f, %.2f, ",
+		(unsigned long long) run.totalBytes, (unsigned long long) run.bodyBytes, completed / seconds,
+		completed > 0 ? concurrency * seconds * 1000 / completed : 0, completed > 0 ? seconds * 1000 / completed : 0,
+		run.totalBytes / 1024.0 / seconds);
+	for (i = 0; i < FIELDS; i++)
+		fprintf(csv, "%.3f, %.3f, %.3f, %.3f, %.3f, ", s[i].min, s[i].mean, s[i].sd, s[i].median, s[i].max);
+	fprintf(csv, "%s p50=%.3f p99=%.3f p999=%.3f\n", sc->name, s[FIELD_TOTAL].median, s[FIELD_TOTAL].p99, s[FIELD_TOTAL].p999);
+	fflush(csv);
+
+	fprintf(stderr, "%-8s  c=%-5d  %-3s  %10.0f req/s  p50 %8.3f  p99 %8.3f  p999 %8.3f ms  failed %d  unexpected %d\n",
+		sc->name, concurrency, sc->keepAlive ? "ka" : "", completed / seconds, s[FIELD_TOTAL].median, s[FIELD_TOTAL].p99, s[FIELD_TOTAL].p999,
+		run.failed, run.unexpected);
+
+	free(run.sample);
+	free(thread);
+	free(worker);
+}
+
+void usage(void) {
+	fputs("Usage: httpbench [-q] [-t name] [-o file] [-s path] [-g path] [-u path] [-l path] [port [host]]\n", stderr);
+	exit(2);
+}
+
+int main(int argc, char** argv) {
+	const char* only = null;
+	boolean quick = false;
+	FILE* csv = stdout;
+	struct addrinfo hints, *info;
+	struct rlimit rl;
+	struct utsname un;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "qt:o:s:g:u:l:")) != -1)
+		switch (opt) {
+		case 'q': quick = true; break;
+		case 't': only = optarg; break;
+		case 'o':
+			csv = fopen(optarg, "w");
+			if (csv == null) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 's': staticPath = optarg; break;
+		case 'g': cgiPath = optarg; break;
+		case 'u': putPath = optarg; break;
+		case 'l': largePath = optarg; break;
+		default: usage();
+		}
+	if (optind < argc)
+		port = argv[optind++];
+	if (optind < argc)
+		host = argv[optind++];
+	if (optind < argc)
+		usage();
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &info)) {
+		fprintf(stderr, "httpbench: cannot resolve %s:%s\n", host, port);
+		return 1;
+	}
+	memcpy(&address, info->ai_addr, info->ai_addrlen);
+	addressLength = info->ai_addrlen;
+	freeaddrinfo(info);
+
+	// as many connections as the hard limit of open files permits
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	getrlimit(RLIMIT_NOFILE, &rl);
+	maxConcurrency = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 1000000 ? 1000000 : (int) rl.rlim_cur - BENCH_DESCRIPTORS;
+
+	uname(&un);
+	fputs("Kernel Version, In Number, In Concurrency, In Keep-Alive, "
+		"Server, Host, Port, Path, Length, Concurrency, Time, Number, "
+		"Failed, Write Errors, Non 2xx, Keep-Alive, "
+		"Total, HTML, Req. per sec, Time per req, Time per conc, Rate, "
+		"Conn Min, Conn Mean, Conn SD, Conn Median, Conn Max, "
+		"Proc Min, Proc Mean, Proc SD, Proc Median, Proc Max, "
+		"Wait Min, Wait Mean, Wait SD, Wait Median, Wait Max, "
+		"Total Min, Total Mean, Total SD, Total Median, Total Max, "
+		"Remark\n", csv);
+
+	for (i = 0; i < SCENARIOS; i++) {
+		const Scenario* sc = &scenario[i];
+		if (only != null && strcmp(only, sc->name))
+			continue;
+		if (quick && sc->concurrency > 1000)
+			continue;
+		benchmark(csv, un.release, sc, quick ? (sc->number + 99) / 100 : sc->number, sc->concurrency);
+	}
+
+	if (largeUploaded)
+		removeFile(largePath);
+	if (csv != stdout)
+		fclose(csv);
+	return 0;
+}
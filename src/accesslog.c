@@ -0,0 +1,147 @@
+/*
+
+mrhttpd v2.8.0
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include "mrhttpd.h"
+
+#ifdef ACCESS_LOG_FILE
+
+// Binary access log
+
+// Every request is recorded as a fixed size AccessRecord in ACCESS_LOG_FILE.
+// The file is mapped into memory in chunks of ACCESS_LOG_CHUNK records, and
+// a request claims its record with an atomic increment, so writing a record
+// costs no system call and no lock. The file grows by one chunk at a time;
+// records never written, e.g. after a crash, remain zero and are skipped by
+// mrhttpd-logdump. On shutdown the file is truncated after the last record.
+
+// ACCESS_LOG_WINDOW chunks are mapped at a time, in a ring of slots. Writers
+// announce themselves in the user count of a slot, and a slot is not remapped
+// before its writers are done. A writer whose chunk has left the window already
+// drops its record.
+
+#define ACCESS_LOG_CHUNK  32768 // records, i.e. 2 MB
+#define ACCESS_LOG_WINDOW 4
+#define ACCESS_LOG_UNMAPPED (~0UL)
+
+_Static_assert(sizeof(AccessRecord) == 64, "AccessRecord must not change size");
+
+typedef struct {
+	unsigned long chunk;      // chunk number currently mapped, or ACCESS_LOG_UNMAPPED
+	int users;                // writers currently accessing the mapping
+	AccessRecord* records;
+} AccessLogSlot;
+
+int accessLogFd = -1;
+unsigned long accessLogNext = 0; // index of the next record in the file
+unsigned long accessLogDropped = 0;
+AccessLogSlot accessLogSlot[ACCESS_LOG_WINDOW];
+pthread_mutex_t accessLogMutex = PTHREAD_MUTEX_INITIALIZER;
+
+boolean accessLogOpen(void) {
+	struct stat st;
+	int i;
+
+	accessLogFd = open(ACCESS_LOG_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	if (accessLogFd < 0 || fstat(accessLogFd, &st))
+		return false;
+	// append to an existing log, after its last complete record
+	accessLogNext = (st.st_size + sizeof(AccessRecord) - 1) / sizeof(AccessRecord);
+	for (i = 0; i < ACCESS_LOG_WINDOW; i++)
+		accessLogSlot[i].chunk = ACCESS_LOG_UNMAPPED;
+	return true;
+}
+
+void accessLogClose(void) {
+	if (accessLogFd >= 0)
+		ftruncate(accessLogFd, __atomic_load_n(&accessLogNext, __ATOMIC_RELAXED) * sizeof(AccessRecord));
+}
+
+// Map the chunk of a record into its slot. Caller holds accessLogMutex.
+// Returns false if the chunk has left the window, or on error.
+
+boolean accessLogMap(AccessLogSlot* slot, const unsigned long chunk) {
+	const off_t chunkSize = ACCESS_LOG_CHUNK * sizeof(AccessRecord);
+	const off_t chunkEnd = (off_t) (chunk + 1) * chunkSize;
+	struct stat st;
+	void* records;
+
+	if (slot->chunk != ACCESS_LOG_UNMAPPED && slot->chunk > chunk)
+		return false; // too late
+	if (slot->chunk != ACCESS_LOG_UNMAPPED) {
+		__atomic_store_n(&slot->chunk, ACCESS_LOG_UNMAPPED, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&slot->users, __ATOMIC_SEQ_CST) > 0)
+			sched_yield(); // a writer is still busy with the old chunk
+		munmap(slot->records, chunkSize);
+	}
+	if (fstat(accessLogFd, &st) || (st.st_size < chunkEnd && ftruncate(accessLogFd, chunkEnd)))
+		return false;
+	records = mmap(null, chunkSize, PROT_READ | PROT_WRITE, MAP_SHARED, accessLogFd, chunk * chunkSize);
+	if (records == MAP_FAILED)
+		return false;
+	slot->records = (AccessRecord*) records;
+	__atomic_store_n(&slot->chunk, chunk, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+void accessLogWrite(const struct timespec* start, const uint32_t client, const int status, const int method, const uint64_t bytes, const char* path) {
+	const unsigned long index = __atomic_fetch_add(&accessLogNext, 1, __ATOMIC_RELAXED);
+	const unsigned long chunk = index / ACCESS_LOG_CHUNK;
+	AccessLogSlot* slot = &accessLogSlot[chunk % ACCESS_LOG_WINDOW];
+	AccessRecord* record;
+	struct timespec now, end;
+	uint32_t hash = 2166136261u; // FNV-1a
+	int i;
+
+	__atomic_add_fetch(&slot->users, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&slot->chunk, __ATOMIC_SEQ_CST) != chunk) {
+		// slow path: map the chunk, once per chunk and slot
+		__atomic_sub_fetch(&slot->users, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_lock(&accessLogMutex);
+		boolean mapped = slot->chunk == chunk || accessLogMap(slot, chunk);
+		pthread_mutex_unlock(&accessLogMutex);
+		if (!mapped) {
+			__atomic_add_fetch(&accessLogDropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		__atomic_add_fetch(&slot->users, 1, __ATOMIC_SEQ_CST);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	clock_gettime(CLOCK_REALTIME, &now);
+	record = slot->records + index % ACCESS_LOG_CHUNK;
+	record->client = client;
+	record->bytes = bytes;
+	record->duration = (end.tv_sec - start->tv_sec) * 1000000 + (end.tv_nsec - start->tv_nsec) / 1000;
+	record->status = status;
+	record->method = method;
+	record->version = ACCESS_LOG_VERSION;
+	memset(record->path, 0, sizeof(record->path));
+	for (i = 0; path != null && path[i] != '\0'; i++) {
+		hash = (hash ^ (unsigned char) path[i]) * 16777619u;
+		if (i < (int) sizeof(record->path))
+			record->path[i] = path[i];
+	}
+	record->pathHash = path == null ? 0 : hash;
+	// the time stamp completes the record
+	__atomic_store_n(&record->time, (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&slot->users, 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,45 @@
+/*
+
+mrhttpd v2.8.0
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+// Format of the binary access log, shared by mrhttpd and mrhttpd-logdump
+
+#ifndef ACCESSLOG_INCLUDE
+#define ACCESSLOG_INCLUDE
+
+#include <stdint.h>
+
+// Record of the binary access log, see accesslog.c and logdump.c.
+// Fields are in native byte order, except for the client address.
+
+#define ACCESS_LOG_VERSION 1
+
+typedef struct {
+	uint64_t time;            // completion of the reply, microseconds since the epoch; 0 if never written
+	uint32_t client;          // IPv4 address of the client, network byte order
+	uint32_t pathHash;        // FNV-1a hash of the complete resource path
+	uint64_t bytes;           // bytes sent, including the reply header
+	uint32_t duration;        // microseconds from the end of the request header to the end of the reply
+	uint16_t status;          // HTTP status code
+	uint8_t method;           // 0 GET, 1 HEAD, 2 PUT, 3 DELETE, 4 POST
+	uint8_t version;          // ACCESS_LOG_VERSION
+	char path[32];            // beginning of the resource path, null padded
+} AccessRecord;               // 64 bytes
+
+#endif
@@ -0,0 +1,242 @@
+/*
+
+mrhttpd v2.8.0
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include "mrhttpd.h"
+
+#if FILE_CACHE_ENTRIES > 0
+
+// Open file cache
+
+// The cache maps the resolved path of a static resource to an open file
+// descriptor, its metadata and a pre-rendered part of the reply header.
+// A cache hit saves the stat(), open(), mimeType() and close() calls.
+
+// The cache is a fixed array of entries split into shards, each protected
+// by a mutex of its own. Within a shard, an entry is found by open addressing
+// with a bounded number of probes. Entries handed out to a request are pinned
+// via a reference count and will not be reused before they are released.
+// Entries expire after FILE_CACHE_TTL seconds, so changes to the file system
+// become visible after that time at the latest.
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_SHARD_SIZE ((FILE_CACHE_ENTRIES + FILE_CACHE_SHARDS - 1) / FILE_CACHE_SHARDS)
+#define FILE_CACHE_PROBES 8
+
+typedef struct {
+	pthread_mutex_t mutex;
+	FileEntry entry[FILE_CACHE_SHARD_SIZE];
+} FileCacheShard;
+
+FileCacheShard fileCache[FILE_CACHE_SHARDS];
+
+#if FILE_CACHE_SMALL_FILE > 0
+long fileCacheMemory = 0; // total size of responses kept in memory
+#endif
+
+void fileCacheInit(void) {
+	int shard;
+
+	for (shard = 0; shard < FILE_CACHE_SHARDS; shard++)
+		pthread_mutex_init(&fileCache[shard].mutex, null);
+}
+
+unsigned fileCacheHash(const char* name, const int length) {
+	unsigned hash = 2166136261u; // FNV-1a
+	int i;
+
+	for (i = 0; i < length; i++)
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+	return hash;
+}
+
+boolean fileEntryMatches(const FileEntry* entry, const unsigned hash, const char* name, const int length) {
+	return entry->hash == hash && entry->nameLength == length && !memcmp(entry->name, name, length);
+}
+
+void fileEntryEvict(FileEntry* entry) {
+	// caller holds the shard mutex and has checked the reference count
+	if (entry->name[0] != '\0') {
+		if (entry->fd >= 0)
+			close(entry->fd);
+		#if FILE_CACHE_SMALL_FILE > 0
+		if (entry->response != null) {
+			__atomic_sub_fetch(&fileCacheMemory, entry->responseHeaderLength + entry->size, __ATOMIC_RELAXED);
+			free(entry->response);
+			entry->response = null;
+		}
+		#endif
+		entry->name[0] = '\0';
+	}
+}
+
+#if FILE_CACHE_SMALL_FILE > 0
+
+// Read a small file into memory, preceded by its reply header and the empty
+// line completing it. Called without the shard mutex, so that the other
+// requests of the shard do not wait for the disk. Returns null if the file
+// is to be served from the file descriptor.
+
+char* fileResponseLoad(const int fd, const char* header, const int headerLength, const off_t fileSize) {
+	const long size = headerLength + 2 + fileSize;
+	char* response;
+
+	if (__atomic_add_fetch(&fileCacheMemory, size, __ATOMIC_RELAXED) > FILE_CACHE_MEMORY)
+		goto _fail; // memory limit exceeded
+	response = (char*) malloc(size);
+	if (response == null)
+		goto _fail;
+	memcpy(response, header, headerLength);
+	memcpy(response + headerLength, "\r\n", 2);
+	if (pread(fd, response + headerLength + 2, fileSize, 0) != fileSize) {
+		free(response);
+		goto _fail;
+	}
+	return response;
+
+_fail:
+	__atomic_sub_fetch(&fileCacheMemory, size, __ATOMIC_RELAXED);
+	return null;
+}
+
+#endif
+
+FileEntry* fileCacheGet(const char* name, const int length) {
+	const unsigned hash = fileCacheHash(name, length);
+	FileCacheShard* shard = &fileCache[hash % FILE_CACHE_SHARDS];
+	FileEntry* entry;
+	int probe;
+
+	pthread_mutex_lock(&shard->mutex);
+	for (probe = 0; probe < FILE_CACHE_PROBES; probe++) {
+		entry = &shard->entry[(hash / FILE_CACHE_SHARDS + probe) % FILE_CACHE_SHARD_SIZE];
+		if (entry->name[0] != '\0' && fileEntryMatches(entry, hash, name, length)) {
+			if (time(null) - entry->loaded > FILE_CACHE_TTL) {
+				if (entry->refCount == 0)
+					fileEntryEvict(entry);
+				break; // expired
+			}
+			__atomic_add_fetch(&entry->refCount, 1, __ATOMIC_ACQUIRE);
+			pthread_mutex_unlock(&shard->mutex);
+			return entry; // hit
+		}
+	}
+	pthread_mutex_unlock(&shard->mutex);
+	return null; // miss
+}
+
+FileEntry* fileCachePut(const char* name, const int length, const int fd, const struct stat* st, const char* contentType, const int variants, const int encoding) {
+	const unsigned hash = fileCacheHash(name, length);
+	FileCacheShard* shard = &fileCache[hash % FILE_CACHE_SHARDS];
+	FileEntry* entry;
+	FileEntry* victim = null;
+	char header[sizeof(entry->header)];
+	MemPool headerPool = { sizeof(header), 0, header };
+	int probe;
+	#if FILE_CACHE_SMALL_FILE > 0
+	char* response = null;
+	#endif
+
+	if (length >= (int) sizeof(entry->name) || strlen(contentType) >= sizeof(entry->contentType))
+		return null; // not cacheable
+	if (addFileHeader(&headerPool, st->st_size, st, contentType, encoding))
+		return null; // header too large
+
+	#if FILE_CACHE_SMALL_FILE > 0
+	// Keep small files in memory as ready-made response, minus status line and connection header
+	if (st->st_size <= FILE_CACHE_SMALL_FILE)
+		response = fileResponseLoad(fd, header, headerPool.current, st->st_size);
+	#endif
+
+	pthread_mutex_lock(&shard->mutex);
+	for (probe = 0; probe < FILE_CACHE_PROBES; probe++) {
+		entry = &shard->entry[(hash / FILE_CACHE_SHARDS + probe) % FILE_CACHE_SHARD_SIZE];
+		if (entry->name[0] != '\0' && fileEntryMatches(entry, hash, name, length)) {
+			// another thread has been faster, or the entry has expired
+			victim = entry->refCount == 0 ? entry : null;
+			break;
+		}
+		if (entry->refCount != 0)
+			continue; // pinned
+		if (victim == null || (victim->name[0] != '\0' && (entry->name[0] == '\0' || entry->loaded < victim->loaded)))
+			victim = entry; // prefer empty entries, then the oldest one
+	}
+	if (victim == null) {
+		pthread_mutex_unlock(&shard->mutex);
+		#if FILE_CACHE_SMALL_FILE > 0
+		if (response != null) {
+			__atomic_sub_fetch(&fileCacheMemory, headerPool.current + 2 + st->st_size, __ATOMIC_RELAXED);
+			free(response);
+		}
+		#endif
+		return null; // no space
+	}
+	fileEntryEvict(victim);
+
+	victim->size = st->st_size;
+	memcpy(victim->contentType, contentType, strlen(contentType) + 1);
+	memcpy(victim->header, header, headerPool.current);
+	victim->headerLength = headerPool.current;
+	victim->fd = fd;
+
+	#if FILE_CACHE_SMALL_FILE > 0
+	if (response != null) {
+		// the file is served from memory from now on
+		victim->response = response;
+		victim->responseHeaderLength = headerPool.current + 2;
+		close(fd);
+		victim->fd = -1;
+	}
+	#endif
+
+	victim->hash = hash;
+	victim->modified = st->st_mtime;
+	victim->inode = st->st_ino;
+	victim->variants = variants;
+	victim->encoding = encoding;
+	victim->loaded = time(null);
+	victim->refCount = 1;
+	memcpy(victim->name, name, length);
+	victim->name[length] = '\0';
+	victim->nameLength = length;
+	pthread_mutex_unlock(&shard->mutex);
+	return victim;
+}
+
+void fileCacheRelease(FileEntry* entry) {
+	__atomic_sub_fetch(&entry->refCount, 1, __ATOMIC_RELEASE);
+}
+
+void fileCacheFlush(void) {
+	FileEntry* entry;
+	int shard, i;
+
+	// evict all entries, or let them expire as soon as they are released
+	for (shard = 0; shard < FILE_CACHE_SHARDS; shard++) {
+		pthread_mutex_lock(&fileCache[shard].mutex);
+		for (i = 0, entry = fileCache[shard].entry; i < FILE_CACHE_SHARD_SIZE; i++, entry++)
+			if (entry->refCount == 0)
+				fileEntryEvict(entry);
+			else
+				entry->loaded = 0;
+		pthread_mutex_unlock(&fileCache[shard].mutex);
+	}
+}
+
+#endif
@@ -0,0 +1,544 @@
+/*
+
+mrhttpd v2.8.0
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include "mrhttpd.h"
+
+#ifdef CGI_PATH
+
+// CGI replies
+
+// The output of a CGI program starts with CGI header lines like Status,
+// Content-Type or Location, terminated by an empty line. A CgiReply turns
+// them into the reply header and relays the body as it arrives. Unless the
+// program tells the length of the body, the body is sent in chunked transfer
+// coding to HTTP/1.1 clients, so the connection can be kept alive. HTTP/1.0
+// clients learn about the end of such a body when the connection is closed.
+
+// A CGI program started per request writes its output to a pipe. The CGI
+// header is read from the pipe; the body is moved to the socket via splice(),
+// without copying it to user space, in chunks of what the pipe holds at
+// the time. The request body is passed on at the same time, see
+// cgiReplyPipe().
+
+void cgiReplyInit(CgiReply* reply, const int socket, const char* protocol, const boolean head, const ConnectionState connectionState, const int flags) {
+	reply->socket = socket;
+	reply->protocol = protocol;
+	reply->connectionState = connectionState;
+	reply->flags = flags;
+	reply->statusCode = HTTP_502;
+	reply->headerDone = false;
+	reply->chunked = false;
+	reply->chunkOpen = false;
+	reply->discard = head;
+	reply->remaining = -1;
+	reply->sent = 0;
+	reply->cgiHeaderLength = 0;
+	reply->replyHeaderLength = 0;
+}
+
+// Offset after the empty line that ends the CGI header, or 0 if the header
+// is not complete yet. Line breaks may be CRLF or LF alone.
+
+int cgiHeaderEnd(const char* header, const int from, const int length) {
+	const char* cp = header + from;
+
+	while ((cp = memchr(cp, '\n', header + length - cp)) != null) {
+		cp++;
+		if (cp < header + length && *cp == '\n')
+			return cp + 1 - header;
+		if (cp + 1 < header + length && cp[0] == '\r' && cp[1] == '\n')
+			return cp + 2 - header;
+	}
+	return 0;
+}
+
+// Translate the CGI header into the reply header, which is sent along with
+// the first piece of the body
+
+boolean cgiReplyHeader(CgiReply* reply, char* header, const int length) {
+	char fieldBuf[HTTP_HEADER_LENGTH];
+	MemPool fields = { sizeof(fieldBuf), 0, fieldBuf }; // header lines passed on to the client
+	MemPool mp = { sizeof(reply->replyHeader), 0, reply->replyHeader };
+	char* status = null;
+	char* contentLength = null;
+	boolean location = false;
+	char* line, *name, *value, *end;
+	int code;
+
+	header[length - 1] = '\0'; // the final line break
+	while ((line = strsep(&header, "\n")) != null) {
+		end = line + strlen(line);
+		if (end > line && end[-1] == '\r')
+			*--end = '\0';
+		if (end == line)
+			continue; // the empty line
+		value = line;
+		name = strsep(&value, ":");
+		if (value == null)
+			return true; // not a header line
+		value = startOf(value);
+		if (!strcasecmp(name, "Status"))
+			status = value;
+		else if (
+			!strcasecmp(name, "Connection") ||
+			!strcasecmp(name, "Keep-Alive") ||
+			!strcasecmp(name, "Transfer-Encoding") ||
+			!strcasecmp(name, "Server")
+		)
+			continue; // up to the server
+		else {
+			if (!strcasecmp(name, "Location"))
+				location = true;
+			else if (!strcasecmp(name, "Content-Length"))
+				contentLength = value;
+			if (
+				memPoolAppend(&fields, name, strlen(name)) ||
+				memPoolAppendLiteral(&fields, ": ") ||
+				memPoolAppend(&fields, value, strlen(value)) ||
+				memPoolAppendLiteral(&fields, "\r\n")
+			)
+				return true;
+		}
+	}
+
+	code = status == null ? (location ? 302 : 200) : atoi(status);
+	if (code < 100 || code > 999)
+		return true;
+	reply->statusCode = httpCodeIndex(code);
+	if (code < 200 || code == 204 || code == 304)
+		reply->discard = true; // no body allowed
+	else if (contentLength != null) {
+		reply->remaining = strtoll(contentLength, &end, 10);
+		if (end == contentLength || *startOf(end) != '\0' || reply->remaining < 0)
+			return true;
+	} else if (!strcmp(reply->protocol, PROTOCOL_HTTP_1_1))
+		reply->chunked = true;
+	else if (!reply->discard)
+		reply->connectionState = CONNECTION_CLOSE; // the end of the connection marks the end of the body
+
+	if (memPoolAppend(&mp, reply->protocol, strlen(reply->protocol)))
+		return true;
+	if (status == null || (strchr(status, ' ') == null && atoi(httpStatusLine[reply->statusCode].text + 1) == code)) {
+		if (memPoolAppendSlice(&mp, httpStatusLine[reply->statusCode]))
+			return true;
+	} else if (
+		memPoolAppendLiteral(&mp, " ") ||
+		memPoolAppend(&mp, status, strlen(status)) ||
+		(strchr(status, ' ') == null && memPoolAppendLiteral(&mp, " ")) || // empty reason phrase
+		memPoolAppendLiteral(&mp, "\r\n")
+	)
+		return true;
+	if (
+		memPoolAppendLiteral(&mp, "Server: " SERVER_SOFTWARE "\r\n") ||
+		#ifdef PRAGMA
+		memPoolAppendLiteral(&mp, "Pragma: " PRAGMA "\r\n") ||
+		#endif
+		memPoolAppend(&mp, fieldBuf, fields.current) ||
+		(reply->chunked && memPoolAppendLiteral(&mp, "Transfer-Encoding: chunked\r\n")) ||
+		memPoolAppendSlice(&mp, connectionLine[reply->connectionState]) ||
+		memPoolAppendLiteral(&mp, "\r\n")
+	)
+		return true;
+	reply->replyHeaderLength = mp.current;
+	return false;
+}
+
+// The line preceding a chunk, with the line break that ends the previous
+// chunk if that is still owed
+
+boolean cgiChunkSize(CgiReply* reply, MemPool* mp, const int length) {
+	boolean owed = reply->chunkOpen;
+
+	reply->chunkOpen = false;
+	return
+		(owed && memPoolAppendLiteral(mp, "\r\n")) ||
+		memPoolAppendHex(mp, length) ||
+		memPoolAppendLiteral(mp, "\r\n");
+}
+
+// Send a piece of the body, preceded by the reply header if that is still
+// pending. With more set, further output follows right away and the piece
+// may wait for it in the socket.
+
+boolean cgiReplyBody(CgiReply* reply, const char* data, int length, const boolean more) {
+	struct iovec iov[4];
+	char sizeBuf[24];
+	MemPool size = { sizeof(sizeBuf), 0, sizeBuf };
+	int count = 0;
+	ssize_t sent;
+
+	if (reply->discard)
+		length = 0;
+	else if (reply->remaining >= 0 && length > reply->remaining)
+		length = reply->remaining; // excess output is dropped
+	if (length == 0)
+		return false; // a pending reply header waits for the body or cgiReplyEnd()
+
+	if (reply->replyHeaderLength > 0) {
+		iov[count].iov_base = reply->replyHeader;
+		iov[count++].iov_len = reply->replyHeaderLength;
+	}
+	if (reply->chunked) {
+		if (cgiChunkSize(reply, &size, length))
+			return true;
+		iov[count].iov_base = sizeBuf;
+		iov[count++].iov_len = size.current;
+	}
+	iov[count].iov_base = (void*) data;
+	iov[count++].iov_len = length;
+	if (reply->chunked) {
+		iov[count].iov_base = "\r\n";
+		iov[count++].iov_len = 2;
+	} else if (reply->remaining >= 0)
+		reply->remaining -= length;
+
+	sent = sendVector(reply->socket, iov, count, more && (reply->chunked || reply->remaining != 0) ? MSG_MORE : 0);
+	if (sent < 0)
+		return true;
+	reply->sent += sent;
+	reply->replyHeaderLength = 0;
+	return false;
+}
+
+// Relay a piece of the output of the CGI program, see cgiReplyBody() for more
+
+boolean cgiReplyData(CgiReply* reply, const char* data, int length, const boolean more) {
+	int from, end, n;
+
+	while (!reply->headerDone) {
+		if (length == 0)
+			return false;
+		n = sizeof(reply->cgiHeader) - reply->cgiHeaderLength;
+		if (n == 0)
+			return true; // CGI header too large
+		if (n > length)
+			n = length;
+		memcpy(reply->cgiHeader + reply->cgiHeaderLength, data, n);
+		from = reply->cgiHeaderLength > 2 ? reply->cgiHeaderLength - 2 : 0;
+		reply->cgiHeaderLength += n;
+		data += n;
+		length -= n;
+		if ((end = cgiHeaderEnd(reply->cgiHeader, from, reply->cgiHeaderLength)) > 0) {
+			if (cgiReplyHeader(reply, reply->cgiHeader, end))
+				return true;
+			reply->headerDone = true;
+			// the rest of the buffer is the beginning of the body
+			if (cgiReplyBody(reply, reply->cgiHeader + end, reply->cgiHeaderLength - end, more || length > 0))
+				return true;
+		}
+	}
+	return cgiReplyBody(reply, data, length, more);
+}
+
+// Write the request to a CGI server process.
+// SIGPIPE is ignored, a closed peer makes the write fail with EPIPE.
+
+boolean cgiWrite(const int fd, const char* buf, ssize_t count) {
+	ssize_t sent;
+
+	while (count > 0) {
+		sent = write(fd, buf, count);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return true;
+		buf += sent;
+		count -= sent;
+	}
+	return false;
+}
+
+// Read the next piece of the request body, from the overspill of
+// parseHeader() first, then from the socket. Returns the number of bytes
+// read, 0 at the end of the body, or -1 on error.
+
+ssize_t cgiBodyRead(CgiBody* body, char* buf, ssize_t count) {
+	ssize_t received;
+
+	if (count > body->remaining)
+		count = body->remaining;
+	if (count == 0)
+		return 0;
+	if (body->stream->current > 0) {
+		if (count > body->stream->current)
+			count = body->stream->current;
+		memcpy(buf, body->stream->mem, count);
+		memPoolConsume(body->stream, count); // keep a pipelined request following the body
+	} else {
+		while ((received = recv(body->socket, buf, count, 0)) < 0) {
+			#ifdef EVENT_MODEL_EPOLL
+			if (awaitSocket(body->socket, POLLIN))
+				continue;
+			#endif
+			if (errno != EINTR)
+				return -1;
+		}
+		if (received == 0)
+			return -1; // the client gave up
+		count = received;
+	}
+	body->remaining -= count;
+	return count;
+}
+
+// Pass the rest of the request body on to a CGI server process
+
+boolean cgiBodyWrite(CgiBody* body, const int fd) {
+	char buf[16384];
+	ssize_t received;
+
+	while ((received = cgiBodyRead(body, buf, sizeof(buf))) > 0)
+		if (cgiWrite(fd, buf, received))
+			return true;
+	return received < 0;
+}
+
+// Pass the request body on to a CGI program through a non-blocking pipe, as
+// far as the pipe takes it without waiting: the overspill of parseHeader()
+// is written, the rest is spliced from the socket. Returns 0 once the body
+// is through, -1 on error, or else the event to wait for: POLLOUT on the
+// pipe, or POLLIN on the socket.
+
+int cgiBodyPipe(CgiBody* body, const int fd) {
+	ssize_t count, moved;
+	int size, used;
+
+	while ((count = body->stream->current < body->remaining ? body->stream->current : body->remaining) > 0) {
+		moved = write(fd, body->stream->mem, count);
+		if (moved < 0 && errno == EINTR)
+			continue;
+		if (moved < 0 && errno == EAGAIN)
+			return POLLOUT;
+		if (moved <= 0)
+			return -1;
+		memPoolConsume(body->stream, moved); // keep a pipelined request following the body
+		body->remaining -= moved;
+	}
+	while (body->remaining > 0) {
+		// POLLOUT promises room for a page only, so ask how much there is
+		if ((size = fcntl(fd, F_GETPIPE_SZ)) < 0 || ioctl(fd, FIONREAD, &used))
+			return -1;
+		if (used >= size)
+			return POLLOUT;
+		moved = socketToPipe(body->socket, fd, size - used < body->remaining ? size - used : body->remaining);
+		if (moved < 0)
+			return errno == EAGAIN ? POLLOUT : -1;
+		if (moved == 0)
+			return POLLIN;
+		body->remaining -= moved;
+	}
+	return 0;
+}
+
+// Make sure that the buffer of the stream holds at least count bytes
+
+boolean cgiStreamFill(CgiStream* stream, const int count) {
+	ssize_t received;
+
+	if (stream->end - stream->start >= count)
+		return false;
+	memmove(stream->data, stream->data + stream->start, stream->end - stream->start);
+	stream->end -= stream->start;
+	stream->start = 0;
+	while (stream->end < count) {
+		received = read(stream->fd, stream->data + stream->end, sizeof(stream->data) - stream->end);
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received <= 0)
+			return true;
+		stream->end += received;
+	}
+	return false;
+}
+
+// Complete the reply once the CGI program has finished
+
+boolean cgiReplyEnd(CgiReply* reply) {
+	struct iovec iov[2];
+	int count = 0;
+	ssize_t sent;
+
+	if (!reply->headerDone)
+		return true; // no valid CGI header
+	if (!reply->discard && reply->remaining > 0)
+		reply->connectionState = CONNECTION_CLOSE; // body shorter than announced, the client can tell by the closed connection
+
+	if (reply->replyHeaderLength > 0) {
+		iov[count].iov_base = reply->replyHeader;
+		iov[count++].iov_len = reply->replyHeaderLength;
+	}
+	if (reply->chunked && !reply->discard) {
+		// last chunk
+		iov[count].iov_base = reply->chunkOpen ? "\r\n0\r\n\r\n" : "0\r\n\r\n";
+		iov[count++].iov_len = reply->chunkOpen ? 7 : 5;
+		reply->chunkOpen = false;
+	}
+	if (count == 0)
+		return false;
+	sent = sendVector(reply->socket, iov, count, reply->connectionState == CONNECTION_KEEPALIVE ? reply->flags : 0);
+	if (sent < 0)
+		return true;
+	reply->sent += sent;
+	reply->replyHeaderLength = 0;
+	return false;
+}
+
+// Move a piece of the body, which the pipe holds already, to the socket
+
+boolean cgiReplySplice(CgiReply* reply, const int fd, int length) {
+	struct iovec iov[2];
+	char sizeBuf[32];
+	MemPool size = { sizeof(sizeBuf), 0, sizeBuf };
+	char discard[4096];
+	int count = 0, more;
+	ssize_t sent;
+
+	if (!reply->discard && reply->remaining >= 0 && length > reply->remaining)
+		length = reply->remaining; // excess output is dropped below
+	if (reply->discard || length == 0) {
+		// read and drop what cannot be sent
+		return read(fd, discard, sizeof(discard)) <= 0;
+	}
+
+	if (reply->replyHeaderLength > 0) {
+		iov[count].iov_base = reply->replyHeader;
+		iov[count++].iov_len = reply->replyHeaderLength;
+	}
+	if (reply->chunked) {
+		if (cgiChunkSize(reply, &size, length))
+			return true;
+		iov[count].iov_base = sizeBuf;
+		iov[count++].iov_len = size.current;
+	}
+	if (count > 0) {
+		if ((sent = sendVector(reply->socket, iov, count, MSG_MORE)) < 0)
+			return true;
+		reply->sent += sent;
+		reply->replyHeaderLength = 0;
+	}
+	if (!reply->chunked && reply->remaining >= 0)
+		reply->remaining -= length;
+	// hold the data back only if more is waiting in the pipe already
+	if (ioctl(fd, FIONREAD, &more))
+		more = 0;
+	if ((sent = pipeToSocket(reply->socket, fd, length, more > length && (reply->chunked || reply->remaining > 0) ? MSG_MORE : 0)) < 0)
+		return true;
+	reply->sent += sent;
+	reply->chunkOpen = reply->chunked; // the line break follows with the next chunk
+	return false;
+}
+
+// Relay the output of a CGI program from a pipe until the program closes it.
+// Meanwhile the request body, if any, is passed on through the pipe bodyFd
+// as far as the program reads it, so a program that writes its output
+// before it has read all of its input does not wait for the server, nor the
+// server for the program. bodyFd is closed once the body is through.
+
+boolean cgiReplyPipe(CgiReply* reply, const int fd, CgiBody* body, int bodyFd) {
+	struct pollfd pfd[2] = { { fd, POLLIN, 0 }, { -1, 0, 0 } };
+	char buf[4096];
+	ssize_t received;
+	int available, wait = 0;
+	boolean rc;
+
+	for (;;) {
+		if (bodyFd >= 0 && (wait = cgiBodyPipe(body, bodyFd)) <= 0) {
+			// the program has the body, or does not take the rest, which is left in the socket
+			if (wait < 0)
+				reply->connectionState = CONNECTION_CLOSE;
+			close(bodyFd);
+			bodyFd = -1;
+		}
+		if ((rc = ioctl(fd, FIONREAD, &available) != 0))
+			break;
+		if (available == 0) {
+			// wait for more output, or for the end of it, or for the body to move on
+			pfd[1].fd = bodyFd < 0 ? -1 : wait == POLLOUT ? bodyFd : body->socket;
+			pfd[1].events = wait;
+			if ((rc = poll(pfd, 2, 1000 * RECEIVE_TIMEOUT) <= 0))
+				break;
+			if (pfd[0].revents == 0)
+				continue;
+			if ((rc = ioctl(fd, FIONREAD, &available) != 0) || available == 0)
+				break; // end of output
+		}
+		if (!reply->headerDone) {
+			// the CGI header has to be parsed, so read it
+			if ((rc = (received = read(fd, buf, sizeof(buf))) <= 0 || cgiReplyData(reply, buf, received, received < available)))
+				break;
+		} else if ((rc = cgiReplySplice(reply, fd, available)))
+			break;
+	}
+	if (bodyFd >= 0) {
+		close(bodyFd);
+		reply->connectionState = CONNECTION_CLOSE; // the rest of the body is left in the socket
+	}
+	return rc;
+}
+
+// Start a CGI program for the request and relay its output. Returns true on
+// error; the reply is incomplete then, or, if reply->sent is still 0, the
+// client has not received anything yet.
+
+boolean cgiRequest(char* fileName, StringPool* env, CgiBody* body, CgiReply* reply) {
+	char* argv[] = { fileName, null };
+	int inFd[2] = { -1, -1 }, outFd[2];
+	boolean rc;
+	pid_t pid;
+
+	if (body->remaining > 0 && pipe2(inFd, O_CLOEXEC))
+		return true;
+	if (inFd[1] >= 0 && fcntl(inFd[1], F_SETFL, O_NONBLOCK)) {
+		close(inFd[0]);
+		close(inFd[1]);
+		return true;
+	}
+	if (pipe2(outFd, O_CLOEXEC)) {
+		if (inFd[0] >= 0) {
+			close(inFd[0]);
+			close(inFd[1]);
+		}
+		return true;
+	}
+	env->strings[env->current] = null;
+	pid = spawnProcess(fileName, argv, env->strings, CGI_DIR, inFd[0], outFd[1]);
+	close(outFd[1]);
+	if (inFd[0] >= 0)
+		close(inFd[0]);
+	if (pid == -1) {
+		if (inFd[1] >= 0)
+			close(inFd[1]);
+		close(outFd[0]);
+		return true;
+	}
+	reaperAdd(pid);
+	#if DEBUG & 256
+	Log(reply->socket, "CGI spawned child %d for %s", pid, fileName);
+	#endif
+	// The body goes in while the output is relayed. If the program does not
+	// read all of it, the rest is left in the socket and the connection closed.
+	// Closing the output pipe early makes the program fail with SIGPIPE.
+	rc = cgiReplyPipe(reply, outFd[0], body, inFd[1]) || cgiReplyEnd(reply);
+	close(outFd[0]);
+	return rc;
+}
+
+#endif
@@ -0,0 +1,282 @@
+/*
+
+mrhttpd v2.8.0
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include "mrhttpd.h"
+
+#if COMPRESS_CACHE_ENTRIES > 0
+
+#include <zlib.h>
+
+// Compression cache
+
+// Static files of a compressible mime type without a precompressed sidecar
+// are gzipped the first time a client asks for it. The compressed variant is
+// kept in an anonymous in-memory file, so it is sent via sendFile() just like
+// the original. An entry is identified by the path and the inode, size and
+// modification time of the original, hence a changed file is compressed anew.
+// Files that do not get any smaller are remembered, too, without a variant.
+
+// The cache holds COMPRESS_CACHE_ENTRIES entries protected by a single mutex,
+// with at most COMPRESS_CACHE_MEMORY bytes of compressed variants. The least
+// recently used entry is replaced. Callers receive a descriptor of their own,
+// so an entry can be replaced while its variant is still being sent.
+
+// A file is compressed by one thread only. The entry is claimed before the
+// compression starts, and other requests for the file are served the
+// original until the variant is ready.
+
+#define COMPRESS_LEVEL 6 // paid by the first request, level 9 takes a quarter longer for next to nothing
+
+typedef struct {
+	int fd;                   // compressed variant, or -1 if not worth it
+	boolean pending;          // being compressed, no variant yet
+	off_t size;               // of the compressed variant
+	off_t originalSize;
+	time_t modified;
+	ino_t inode;
+	time_t used;
+	char name[256];
+} CompressEntry;
+
+pthread_mutex_t compressCacheMutex;
+CompressEntry compressCache[COMPRESS_CACHE_ENTRIES];
+off_t compressCacheMemory = 0; // total size of the cached variants
+
+void compressCacheInit(void) {
+	pthread_mutex_init(&compressCacheMutex, null);
+}
+
+// Create an anonymous file for a compressed variant
+
+int compressTempFile(void) {
+	#ifdef MFD_CLOEXEC
+	return memfd_create(SERVER_NAME, MFD_CLOEXEC);
+	#else
+	char name[] = P_tmpdir "/" SERVER_NAME "-XXXXXX";
+	int fd = mkstemp(name);
+	if (fd >= 0)
+		unlink(name);
+	return fd;
+	#endif
+}
+
+// Deflate the first size bytes of a file into an anonymous file in gzip format.
+// Returns the descriptor of the anonymous file, or -1.
+
+int compressGzip(const int source, const off_t size, off_t* compressedSize) {
+	unsigned char in[16384], out[16384];
+	z_stream zs;
+	off_t offset = 0;
+	ssize_t count;
+	int fd, flush;
+
+	fd = compressTempFile();
+	if (fd < 0)
+		return -1;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) { // 16: gzip wrapper
+		close(fd);
+		return -1;
+	}
+	*compressedSize = 0;
+	do {
+		count = pread(source, in, size - offset < (off_t) sizeof(in) ? size - offset : (off_t) sizeof(in), offset);
+		if (count < 0)
+			goto _fail;
+		offset += count;
+		flush = count == 0 || offset >= size ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_in = in;
+		zs.avail_in = count;
+		do {
+			zs.next_out = out;
+			zs.avail_out = sizeof(out);
+			if (deflate(&zs, flush) == Z_STREAM_ERROR)
+				goto _fail;
+			count = sizeof(out) - zs.avail_out;
+			if (count > 0 && write(fd, out, count) != count)
+				goto _fail;
+			*compressedSize += count;
+		} while (zs.avail_out == 0);
+	} while (flush != Z_FINISH);
+	deflateEnd(&zs);
+	return fd;
+
+_fail:
+	deflateEnd(&zs);
+	close(fd);
+	return -1;
+}
+
+CompressEntry* compressCacheFind(const char* name, const struct stat* st) {
+	CompressEntry* entry;
+	int i;
+
+	// caller holds the mutex
+	for (i = 0, entry = compressCache; i < COMPRESS_CACHE_ENTRIES; i++, entry++)
+		if (entry->inode == st->st_ino && entry->modified == st->st_mtime && entry->originalSize == st->st_size &&
+			entry->name[0] != '\0' && !strcmp(entry->name, name))
+			return entry;
+	return null;
+}
+
+void compressEntryClear(CompressEntry* entry) {
+	// caller holds the mutex
+	if (entry->name[0] != '\0' && entry->fd >= 0) {
+		close(entry->fd);
+		compressCacheMemory -= entry->size;
+	}
+	entry->fd = -1;
+	entry->name[0] = '\0';
+}
+
+// Find an entry for a new file: an empty one, or else the least recently used one
+
+CompressEntry* compressCacheVictim(void) {
+	CompressEntry* victim = null;
+	CompressEntry* entry;
+	int i;
+
+	// caller holds the mutex
+	for (i = 0, entry = compressCache; i < COMPRESS_CACHE_ENTRIES; i++, entry++) {
+		if (entry->pending)
+			continue;
+		if (entry->name[0] == '\0')
+			return entry;
+		if (victim == null || entry->used < victim->used)
+			victim = entry;
+	}
+	return victim; // null if all entries are being compressed
+}
+
+// Drop the least recently used variants until another size bytes fit.
+// Returns false if they do not.
+
+boolean compressCacheMakeRoom(const off_t size) {
+	CompressEntry* victim;
+	CompressEntry* entry;
+	int i;
+
+	// caller holds the mutex
+	if (size > COMPRESS_CACHE_MEMORY)
+		return false;
+	while (compressCacheMemory + size > COMPRESS_CACHE_MEMORY) {
+		victim = null;
+		for (i = 0, entry = compressCache; i < COMPRESS_CACHE_ENTRIES; i++, entry++)
+			if (!entry->pending && entry->name[0] != '\0' && entry->fd >= 0 && (victim == null || entry->used < victim->used))
+				victim = entry;
+		if (victim == null)
+			return false;
+		compressEntryClear(victim);
+	}
+	return true;
+}
+
+// Get the gzipped variant of a static file, compressing it if necessary.
+// On success, returns a descriptor owned by the caller and the status of the
+// variant: that of the original file, but with the compressed size.
+// Returns -1 if there is no variant, or if it is not ready yet.
+
+int compressCacheGet(const char* name, const struct stat* st, struct stat* variant) {
+	CompressEntry* entry;
+	off_t size;
+	int fd, source;
+	boolean failed;
+
+	if (strlen(name) >= sizeof(entry->name))
+		return -1;
+
+	pthread_mutex_lock(&compressCacheMutex);
+	entry = compressCacheFind(name, st);
+	if (entry != null) {
+		if (entry->pending) {
+			pthread_mutex_unlock(&compressCacheMutex);
+			return -1; // another thread is compressing the file
+		}
+		entry->used = time(null);
+		fd = entry->fd < 0 ? -1 : dup(entry->fd);
+		size = entry->size;
+		pthread_mutex_unlock(&compressCacheMutex);
+		goto _found;
+	}
+	// claim an entry, so that no other thread compresses the file, too
+	entry = compressCacheVictim();
+	if (entry == null) {
+		pthread_mutex_unlock(&compressCacheMutex);
+		return -1;
+	}
+	compressEntryClear(entry);
+	entry->pending = true;
+	entry->originalSize = st->st_size;
+	entry->modified = st->st_mtime;
+	entry->inode = st->st_ino;
+	entry->used = time(null);
+	strcpy(entry->name, name);
+	pthread_mutex_unlock(&compressCacheMutex);
+
+	// compress outside of the mutex, it takes a while
+	fd = -1;
+	source = open(name, O_RDONLY);
+	if (source >= 0) {
+		fd = compressGzip(source, st->st_size, &size);
+		close(source);
+	}
+	failed = fd < 0;
+	if (fd >= 0 && size >= st->st_size) {
+		close(fd); // not worth it
+		fd = -1;
+	}
+
+	pthread_mutex_lock(&compressCacheMutex);
+	entry->pending = false;
+	if (failed)
+		entry->name[0] = '\0'; // try again with the next request
+	else if (fd >= 0) {
+		entry->size = size;
+		if (compressCacheMakeRoom(size) && (entry->fd = dup(fd)) >= 0)
+			compressCacheMemory += size;
+		else
+			entry->name[0] = '\0'; // serve it, but do not cache it
+	}
+	pthread_mutex_unlock(&compressCacheMutex);
+
+_found:
+	if (fd < 0)
+		return -1;
+	*variant = *st;
+	variant->st_size = size;
+	return fd;
+}
+
+// Gzip a generated file, such as a directory listing, without caching it.
+// Returns a descriptor owned by the caller and the status of the variant, or -1.
+
+int compressTemporary(const int source, const struct stat* st, struct stat* variant) {
+	off_t size;
+	int fd;
+
+	fd = compressGzip(source, st->st_size, &size);
+	if (fd < 0)
+		return -1;
+	*variant = *st;
+	variant->st_size = size;
+	return fd;
+}
+
+#endif
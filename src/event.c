@@ -0,0 +1,577 @@
+/*
+
+mrhttpd v2.8.0
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include "mrhttpd.h"
+
+#ifdef EVENT_MODEL_EPOLL
+
+// Event model "epoll"
+
+// A fixed set of event loop threads multiplexes all client connections.
+// The sockets are non-blocking, and a loop thread never waits for one of
+// them: it reads until the request header is complete, and it queues the
+// part of a reply that the socket cannot take right away. Until then the
+// connection goes back to the epoll set of its loop, and the loop carries
+// on with other connections. Idle keep-alive connections cost neither a
+// thread nor a stack, and a connection in the middle of a request holds
+// the partial header and the queued output, nothing else.
+
+// Requests that may have to wait for the client or for a CGI program,
+// i.e. PUT and POST requests with their bodies, CGI requests and headers
+// too large for the stream buffer, are served by a thread of their own,
+// which hands the connection back to its loop afterwards. Such a thread
+// uses the blocking waits of io.c with the usual timeouts.
+
+// Every loop keeps its waiting connections in two lists, one for the
+// receive and one for the send timeout, ordered by the start of the wait.
+// Expired connections are found at the head of the lists.
+
+#define EVENT_BATCH 64
+
+enum { EVENT_RECEIVE, EVENT_SEND, EVENT_LISTS }; // timeout lists
+
+typedef struct EventChunk {
+	struct EventChunk* next;
+	int fd;                   // file to be sent from, or -1 for the data below
+	off_t offset;             // into the file or the data
+	size_t length;            // still to be sent
+	char data[];
+} EventChunk;
+
+typedef struct {
+	MemPool pool;
+	char mem[HTTP_HEADER_LENGTH];
+} EventStream;
+
+typedef struct {
+	int loop;                 // owning event loop
+	int list;                 // timeout list, or -1
+	int prev, next;           // neighbours in the timeout list or the hand-over stack, or -1
+	boolean registered;       // in the epoll set of the loop
+	boolean closing;          // to be closed once the queued output is out
+	time_t since;             // start of the current wait
+	EventStream* stream;      // request data kept between events, or null
+	EventChunk* output;       // reply data the socket could not take yet, or null
+	EventChunk* outputTail;
+} EventSlot;
+
+typedef struct {
+	int epollFd;
+	int wakeFd;               // eventfd, signalled when connections are handed over
+	pthread_mutex_t mutex;    // protects the hand-over stack
+	int handOver;             // connections handed over by other threads, or -1
+	int head[EVENT_LISTS];
+	int tail[EVENT_LISTS];
+} EventLoop;
+
+const int eventTimeout[EVENT_LISTS] = { RECEIVE_TIMEOUT, SEND_TIMEOUT };
+
+EventLoop eventLoop[EVENT_THREADS];
+EventSlot* eventSlot; // indexed by socket
+int eventSlotCount;
+unsigned eventNext = 0;
+
+__thread boolean eventLoopThread = false;
+
+void eventListRemove(const int socket) {
+	EventSlot* slot = &eventSlot[socket];
+	EventLoop* el = &eventLoop[slot->loop];
+
+	if (slot->list < 0)
+		return;
+	if (slot->prev >= 0)
+		eventSlot[slot->prev].next = slot->next;
+	else
+		el->head[slot->list] = slot->next;
+	if (slot->next >= 0)
+		eventSlot[slot->next].prev = slot->prev;
+	else
+		el->tail[slot->list] = slot->prev;
+	slot->list = -1;
+}
+
+// Start a wait of the connection, at the tail of the timeout list
+
+void eventListAdd(const int socket, const int list) {
+	EventSlot* slot = &eventSlot[socket];
+	EventLoop* el = &eventLoop[slot->loop];
+
+	eventListRemove(socket);
+	slot->since = time(null);
+	slot->list = list;
+	slot->next = -1;
+	slot->prev = el->tail[list];
+	if (slot->prev >= 0)
+		eventSlot[slot->prev].next = socket;
+	else
+		el->head[list] = socket;
+	el->tail[list] = socket;
+}
+
+// Called by the loop thread, or by the thread serving a request on its own.
+// The connection is in no timeout list then.
+
+void eventClose(const int socket) {
+	EventSlot* slot = &eventSlot[socket];
+	EventChunk* chunk;
+
+	eventListRemove(socket);
+	while ((chunk = slot->output) != null) {
+		slot->output = chunk->next;
+		if (chunk->fd >= 0)
+			close(chunk->fd);
+		free(chunk);
+	}
+	free(slot->stream);
+	slot->stream = null;
+	if (slot->registered)
+		epoll_ctl(eventLoop[slot->loop].epollFd, EPOLL_CTL_DEL, socket, null);
+	slot->registered = false;
+	#if DEBUG & 1
+	Log(socket, "Event loop %d finished socket %d", slot->loop, socket);
+	#endif
+	close(socket); // the slot may be reused from here on
+	#ifdef METRICS_PATH
+	metricsConnection(-1);
+	#endif
+}
+
+boolean eventArm(const int socket, const uint32_t events) {
+	EventSlot* slot = &eventSlot[socket];
+	struct epoll_event event;
+
+	event.events = events | EPOLLONESHOT;
+	event.data.fd = socket;
+	if (epoll_ctl(eventLoop[slot->loop].epollFd, slot->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, socket, &event))
+		return false;
+	slot->registered = true;
+	return true;
+}
+
+// Hand a connection over to its loop: a new one, or one that has been
+// served by a thread of its own
+
+void eventHandOver(const int socket) {
+	EventLoop* el = &eventLoop[eventSlot[socket].loop];
+	const uint64_t one = 1;
+	boolean wake;
+
+	pthread_mutex_lock(&el->mutex);
+	wake = el->handOver < 0; // otherwise the loop has been woken already
+	eventSlot[socket].next = el->handOver;
+	el->handOver = socket;
+	pthread_mutex_unlock(&el->mutex);
+	if (wake && write(el->wakeFd, &one, sizeof(one)) < 0) {
+		#if DEBUG & 128
+		Log(socket, "Event loop wake-up failed for socket %d", socket);
+		#endif
+	}
+}
+
+// Output queue, filled by the send functions of io.c in a loop thread
+
+boolean eventQueued(const int socket) {
+	return eventLoopThread && eventSlot[socket].output != null;
+}
+
+EventChunk* eventChunk(const int socket, const size_t length) {
+	EventSlot* slot = &eventSlot[socket];
+	EventChunk* chunk;
+
+	if ((chunk = (EventChunk*) malloc(sizeof(EventChunk) + length)) == null)
+		return null;
+	chunk->next = null;
+	chunk->fd = -1;
+	chunk->offset = 0;
+	chunk->length = length;
+	if (slot->output == null)
+		slot->output = chunk;
+	else
+		slot->outputTail->next = chunk;
+	slot->outputTail = chunk;
+	return chunk;
+}
+
+ssize_t eventQueue(const int socket, const char* data, const ssize_t count) {
+	EventChunk* chunk;
+
+	if ((chunk = eventChunk(socket, count)) == null)
+		return -1;
+	memcpy(chunk->data, data, count);
+	return count;
+}
+
+ssize_t eventQueueVector(const int socket, const struct iovec* iov, int count) {
+	EventChunk* chunk;
+	size_t length = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		length += iov[i].iov_len;
+	if ((chunk = eventChunk(socket, length)) == null)
+		return -1;
+	for (i = 0, length = 0; i < count; i++) {
+		memcpy(chunk->data + length, iov[i].iov_base, iov[i].iov_len);
+		length += iov[i].iov_len;
+	}
+	return length;
+}
+
+ssize_t eventQueueFile(const int socket, const int fd, const off_t offset, const ssize_t count) {
+	EventChunk* chunk;
+
+	if ((chunk = eventChunk(socket, 0)) == null)
+		return -1;
+	chunk->length = count;
+	chunk->offset = offset;
+	// a copy of the descriptor, the file may be closed or evicted from the cache meanwhile
+	if ((chunk->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+		return -1; // the chunk is freed with the connection
+	return count;
+}
+
+// Send as much of the queued output as the socket takes. Returns the number
+// of bytes sent, or -1 on error.
+
+ssize_t eventFlush(const int socket) {
+	EventSlot* slot = &eventSlot[socket];
+	EventChunk* chunk;
+	ssize_t totalSent = 0, sent;
+
+	while ((chunk = slot->output) != null) {
+		if (chunk->fd >= 0)
+			sent = sendfile(socket, chunk->fd, &chunk->offset, chunk->length);
+		else
+			sent = send(socket, chunk->data + chunk->offset, chunk->length, MSG_NOSIGNAL | (chunk->next != null ? MSG_MORE : 0));
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			break;
+		if (sent <= 0)
+			return -1;
+		if (chunk->fd < 0)
+			chunk->offset += sent; // sendfile() has advanced the file offset
+		chunk->length -= sent;
+		totalSent += sent;
+		if (chunk->length == 0) {
+			slot->output = chunk->next;
+			if (chunk->fd >= 0)
+				close(chunk->fd);
+			free(chunk);
+		}
+	}
+	return totalSent;
+}
+
+// The stream buffer holds a complete request header
+
+boolean eventHeaderComplete(const MemPool* stream) {
+	return memmem(stream->mem, stream->current, "\r\n\r\n", 4) != null;
+}
+
+// Read until the stream buffer holds a complete request header, or as much
+// of it as fits. Returns 1 then, 0 if the socket has no more data for now,
+// and -1 if the connection is closed or broken.
+
+int eventReceive(const int socket, MemPool* stream) {
+	ssize_t received;
+
+	while (!eventHeaderComplete(stream) && stream->current < stream->size) {
+		received = recv(socket, stream->mem + stream->current, stream->size - stream->current, 0);
+		if (received > 0)
+			stream->current += received;
+		else if (received < 0 && errno == EINTR)
+			continue;
+		else if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		else
+			return -1;
+	}
+	return 1;
+}
+
+// Requests that may have to wait for the client or a CGI program
+
+boolean eventBlocking(const MemPool* stream) {
+	if (!eventHeaderComplete(stream))
+		return true; // header too large, parseHeader() skips lines while reading on
+	if (!memcmp(stream->mem, "PUT ", 4) || !memcmp(stream->mem, "POST ", 5))
+		return true; // request body
+	#ifdef CGI_PATH
+	char resourceBuf[512];
+	char* resource = resourceBuf;
+	const char* start = memchr(stream->mem, ' ', stream->current);
+	int length;
+
+	if (start == null)
+		return false; // broken, httpRequest() will say so
+	start++;
+	length = strcspn(start, " ?\r"); // the header is terminated by "\r\n\r\n"
+	if (length >= (int) sizeof(resourceBuf))
+		return false; // too long to name a CGI script
+	memcpy(resourceBuf, start, length);
+	resourceBuf[length] = '\0';
+	if (urlDecode(resourceBuf))
+		return false;
+	#ifdef PATH_PREFIX
+	if (!strncmp(resource, PATH_PREFIX, strlen(PATH_PREFIX)))
+		resource += strlen(PATH_PREFIX);
+	#endif
+	if (!strncmp(resource, CGI_PATH, strlen(CGI_PATH)))
+		return true;
+	#endif
+	return false;
+}
+
+// Keep the request data of the connection between events. Returns false
+// if memory is short.
+
+boolean eventKeep(const int socket, MemPool* stream) {
+	EventSlot* slot = &eventSlot[socket];
+
+	if (stream->current == 0) {
+		free(slot->stream);
+		slot->stream = null;
+	} else if (slot->stream == null) {
+		if ((slot->stream = (EventStream*) malloc(sizeof(EventStream))) == null)
+			return false;
+		slot->stream->pool.size = sizeof(slot->stream->mem);
+		slot->stream->pool.current = stream->current;
+		slot->stream->pool.mem = slot->stream->mem;
+		memcpy(slot->stream->mem, stream->mem, stream->current);
+	}
+	return true;
+}
+
+// A thread serving a request that may have to wait
+
+void* eventThread(void* arg) {
+	const int socket = (int) (long) arg; // Non-portable kludge to implement call-by-value
+	MemPool* stream = &eventSlot[socket].stream->pool;
+	ConnectionState connectionState;
+
+	pthread_detach(pthread_self());
+	do
+		connectionState = httpRequest(socket, stream);
+	while (connectionState == CONNECTION_KEEPALIVE && stream->current > 0);
+	if (connectionState == CONNECTION_KEEPALIVE)
+		eventHandOver(socket);
+	else
+		eventClose(socket);
+	return null;
+}
+
+// Serve the requests of a connection as far as possible without waiting
+
+void eventServe(const int socket, MemPool* loopStream) {
+	EventSlot* slot = &eventSlot[socket];
+	MemPool* stream = slot->stream != null ? &slot->stream->pool : loopStream;
+	boolean resumed = slot->stream != null && slot->list == EVENT_RECEIVE; // a partial request header is waiting
+	pthread_t threadId;
+	int rc;
+
+	if (stream == loopStream)
+		memPoolReset(stream);
+	while (slot->output == null) {
+		if ((rc = eventReceive(socket, stream)) < 0) {
+			eventClose(socket);
+			return;
+		}
+		if (rc == 0)
+			break;
+		resumed = false;
+		if (eventBlocking(stream)) {
+			eventListRemove(socket);
+			if (!eventKeep(socket, stream) || pthread_create(&threadId, null, eventThread, (void*) (long) socket))
+				eventClose(socket);
+			return;
+		}
+		if (httpRequest(socket, stream) != CONNECTION_KEEPALIVE) {
+			if (slot->output == null) {
+				eventClose(socket);
+				return;
+			}
+			slot->closing = true;
+		}
+	}
+
+	if (!eventKeep(socket, stream)) {
+		eventClose(socket);
+		return;
+	}
+	if (slot->output != null) {
+		eventListAdd(socket, EVENT_SEND);
+		if (!eventArm(socket, EPOLLOUT))
+			eventClose(socket);
+		return;
+	}
+	// The receive timeout runs from the end of the previous request, or from
+	// the first part of the current header, so a client cannot extend it by
+	// trickling data.
+	if (!resumed)
+		eventListAdd(socket, EVENT_RECEIVE);
+	if (!eventArm(socket, EPOLLIN | EPOLLRDHUP))
+		eventClose(socket);
+}
+
+// The socket has room for queued output
+
+void eventSend(const int socket, MemPool* loopStream) {
+	EventSlot* slot = &eventSlot[socket];
+	ssize_t sent;
+
+	if ((sent = eventFlush(socket)) < 0) {
+		eventClose(socket);
+		return;
+	}
+	if (slot->output != null) {
+		if (sent > 0)
+			eventListAdd(socket, EVENT_SEND); // the send timeout applies to progress
+		if (!eventArm(socket, EPOLLOUT))
+			eventClose(socket);
+		return;
+	}
+	eventListRemove(socket);
+	if (slot->closing)
+		eventClose(socket);
+	else
+		eventServe(socket, loopStream); // a pipelined request may be waiting in the stream
+}
+
+// Take over the connections handed over by other threads
+
+void eventTakeOver(const int loop, MemPool* loopStream) {
+	EventLoop* el = &eventLoop[loop];
+	uint64_t count;
+	int socket;
+
+	if (read(el->wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return;
+	pthread_mutex_lock(&el->mutex);
+	socket = el->handOver;
+	el->handOver = -1;
+	pthread_mutex_unlock(&el->mutex);
+	while (socket >= 0) {
+		const int next = eventSlot[socket].next;
+		eventServe(socket, loopStream);
+		socket = next;
+	}
+}
+
+void eventSweep(const int loop, const time_t now) {
+	EventLoop* el = &eventLoop[loop];
+	int list;
+
+	for (list = 0; list < EVENT_LISTS; list++)
+		while (el->head[list] >= 0 && now - eventSlot[el->head[list]].since > eventTimeout[list])
+			eventClose(el->head[list]);
+}
+
+void* eventRun(void* arg) {
+	const int loop = (int) (long) arg; // Non-portable kludge to implement call-by-value
+	EventLoop* el = &eventLoop[loop];
+	struct epoll_event event[EVENT_BATCH];
+	char streamBuf[HTTP_HEADER_LENGTH];
+	MemPool stream = { sizeof(streamBuf), 0, streamBuf }; // for connections without request data kept
+	time_t lastSweep = time(null);
+	time_t now;
+	int i, count;
+
+	#if DEBUG & 1
+	Log(el->epollFd, "Event loop %d starting", loop);
+	#endif
+
+	eventLoopThread = true;
+	for (;;) {
+		count = epoll_wait(el->epollFd, event, EVENT_BATCH, 1000);
+		for (i = 0; i < count; i++) {
+			const int socket = event[i].data.fd;
+			if (socket == el->wakeFd)
+				eventTakeOver(loop, &stream);
+			else if (eventSlot[socket].output != null)
+				eventSend(socket, &stream);
+			else
+				eventServe(socket, &stream);
+		}
+		now = time(null);
+		if (now != lastSweep) {
+			eventSweep(loop, now);
+			lastSweep = now;
+		}
+	}
+
+	return null;
+}
+
+boolean eventInit(void) {
+	struct rlimit rl;
+	struct epoll_event event;
+	pthread_t threadId;
+	int loop, list;
+
+	// one slot per possible file descriptor, set up when the socket is dispatched
+	if (getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 24))
+		return false;
+	eventSlotCount = (int) rl.rlim_cur;
+	eventSlot = (EventSlot*) calloc(eventSlotCount, sizeof(EventSlot));
+	if (eventSlot == null)
+		return false;
+
+	for (loop = 0; loop < EVENT_THREADS; loop++) {
+		EventLoop* el = &eventLoop[loop];
+		if ((el->epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0 || (el->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+			return false;
+		event.events = EPOLLIN;
+		event.data.fd = el->wakeFd;
+		if (epoll_ctl(el->epollFd, EPOLL_CTL_ADD, el->wakeFd, &event))
+			return false;
+		pthread_mutex_init(&el->mutex, null);
+		el->handOver = -1;
+		for (list = 0; list < EVENT_LISTS; list++)
+			el->head[list] = el->tail[list] = -1;
+	}
+	for (loop = 0; loop < EVENT_THREADS; loop++)
+		if (pthread_create(&threadId, null, eventRun, (void*) (long) loop))
+			return false;
+	return true;
+}
+
+void eventDispatch(const int socket) {
+	EventSlot* slot;
+
+	if (socket >= eventSlotCount || fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK) < 0) {
+		close(socket);
+		return;
+	}
+	slot = &eventSlot[socket];
+	slot->loop = __atomic_fetch_add(&eventNext, 1, __ATOMIC_RELAXED) % EVENT_THREADS; // round robin distribution
+	slot->list = -1;
+	slot->registered = false;
+	slot->closing = false;
+	slot->stream = null;
+	slot->output = null;
+	#ifdef METRICS_PATH
+	metricsConnection(1); // before the loop can close it
+	#endif
+	#if DEBUG & 1
+	Log(socket, "Event loop %d starting socket %d", slot->loop, socket);
+	#endif
+	eventHandOver(socket); // the loop reads the request right away
+}
+
+#endif
@@ -0,0 +1,251 @@
+/*
+
+mrhttpd v2.8.0
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include "mrhttpd.h"
+
+#ifdef FASTCGI_SOCKET
+
+// FastCGI
+
+// Requests for CGI_PATH are passed to a FastCGI responder listening on the
+// Unix socket FASTCGI_SOCKET instead of starting the program for each of
+// them. Connections to the responder are kept open with FCGI_KEEP_CONN and
+// reused; up to FASTCGI_POOL idle connections are kept in a pool. The most
+// recently used connection is reused first. A pooled connection may have been
+// closed by the responder in the meantime; the request is then repeated on a
+// new connection, provided that nothing has been received yet.
+
+// The output of the responder is relayed to the client record by record as
+// it arrives, see cgi.c.
+
+#define FASTCGI_POOL   32
+
+#define FCGI_VERSION_1        1
+#define FCGI_BEGIN_REQUEST    1
+#define FCGI_END_REQUEST      3
+#define FCGI_PARAMS           4
+#define FCGI_STDIN            5
+#define FCGI_STDOUT           6
+#define FCGI_STDERR           7
+#define FCGI_RESPONDER        1
+#define FCGI_KEEP_CONN        1
+#define FCGI_REQUEST_COMPLETE 0
+
+int fastcgiIdle[FASTCGI_POOL];
+int fastcgiIdleCount = 0;
+pthread_mutex_t fastcgiMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// A connection to the responder, from the pool if possible
+
+int fastcgiConnect(boolean* pooled) {
+	struct sockaddr_un sa;
+	int fd = -1;
+
+	pthread_mutex_lock(&fastcgiMutex);
+	if (fastcgiIdleCount > 0)
+		fd = fastcgiIdle[--fastcgiIdleCount];
+	pthread_mutex_unlock(&fastcgiMutex);
+	if ((*pooled = fd >= 0))
+		return fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, FASTCGI_SOCKET, sizeof(sa.sun_path) - 1);
+	if (connect(fd, (struct sockaddr*) &sa, sizeof(sa))) {
+		close(fd);
+		return -1;
+	}
+	setTimeout(fd);
+	return fd;
+}
+
+// Return a connection to the pool after a complete request
+
+void fastcgiRelease(const int fd) {
+	boolean pooled = false;
+
+	pthread_mutex_lock(&fastcgiMutex);
+	if (fastcgiIdleCount < FASTCGI_POOL) {
+		fastcgiIdle[fastcgiIdleCount++] = fd;
+		pooled = true;
+	}
+	pthread_mutex_unlock(&fastcgiMutex);
+	if (!pooled)
+		close(fd);
+}
+
+// Begin a record of request 1; fastcgiRecordEnd() fills in the length
+
+boolean fastcgiRecord(MemPool* mp, const int type) {
+	const char header[8] = { FCGI_VERSION_1, type, 0, 1, 0, 0, 0, 0 };
+
+	return memPoolAppend(mp, header, sizeof(header));
+}
+
+void fastcgiRecordEnd(MemPool* mp, const int record) {
+	const int length = mp->current - record - 8;
+
+	mp->mem[record + 4] = length >> 8;
+	mp->mem[record + 5] = length & 255;
+}
+
+boolean fastcgiLength(MemPool* mp, const int length) {
+	const char buf[4] = { (length >> 24) | 0x80, length >> 16, length >> 8, length };
+
+	return length < 128 ? memPoolAppend(mp, buf + 3, 1) : memPoolAppend(mp, buf, 4);
+}
+
+// The request: FCGI_BEGIN_REQUEST, the environment of the CGI program as
+// name-value pairs in FCGI_PARAMS. fastcgiStdin() sends the body.
+
+boolean fastcgiRequestEncode(MemPool* mp, const StringPool* env) {
+	static const char begin[16] = { FCGI_VERSION_1, FCGI_BEGIN_REQUEST, 0, 1, 0, 8, 0, 0, 0, FCGI_RESPONDER, FCGI_KEEP_CONN };
+	const char* variable, *value;
+	int record, i, nameLength, valueLength;
+
+	if (memPoolAppend(mp, begin, sizeof(begin)))
+		return true;
+	record = mp->current;
+	if (fastcgiRecord(mp, FCGI_PARAMS))
+		return true;
+	for (i = 0; i < env->current; i++) {
+		variable = env->strings[i];
+		if ((value = strchr(variable, '=')) == null)
+			continue;
+		nameLength = value++ - variable;
+		valueLength = strlen(value);
+		if (mp->current - record + nameLength + valueLength > 65535) { // 8 bytes spare for the lengths
+			fastcgiRecordEnd(mp, record);
+			record = mp->current;
+			if (fastcgiRecord(mp, FCGI_PARAMS))
+				return true;
+		}
+		if (
+			fastcgiLength(mp, nameLength) ||
+			fastcgiLength(mp, valueLength) ||
+			memPoolAppend(mp, variable, nameLength) ||
+			memPoolAppend(mp, value, valueLength)
+		)
+			return true;
+	}
+	fastcgiRecordEnd(mp, record);
+	// an empty record closes the stream
+	return fastcgiRecord(mp, FCGI_PARAMS);
+}
+
+// The request body in FCGI_STDIN records, and an empty one to close the stream
+
+boolean fastcgiStdin(const int fd, CgiBody* body) {
+	char buf[8 + 16384];
+	MemPool record = { sizeof(buf), 0, buf };
+	ssize_t received;
+
+	do {
+		record.current = 0;
+		if (fastcgiRecord(&record, FCGI_STDIN) || (received = cgiBodyRead(body, buf + 8, sizeof(buf) - 8)) < 0)
+			return true;
+		record.current += received;
+		fastcgiRecordEnd(&record, 0);
+		if (cgiWrite(fd, buf, record.current))
+			return true;
+	} while (received > 0);
+	return false;
+}
+
+// Relay the records of the responder until FCGI_END_REQUEST. Returns 0 on
+// success, 1 if the connection failed before anything was received, and -1
+// on any other error.
+
+int fastcgiRelay(CgiStream* stream, CgiReply* reply) {
+	const unsigned char* header;
+	int type, length, padding, n;
+	boolean received = false;
+
+	for (;;) {
+		if (cgiStreamFill(stream, 8))
+			return received ? -1 : 1;
+		received = true;
+		header = (const unsigned char*) stream->data + stream->start;
+		type = header[1];
+		length = header[4] << 8 | header[5];
+		padding = header[6];
+		stream->start += 8;
+		if (type == FCGI_END_REQUEST) {
+			if (length < 8 || cgiStreamFill(stream, length + padding))
+				return -1;
+			n = stream->data[stream->start + 4]; // protocol status
+			stream->start += length + padding;
+			return n == FCGI_REQUEST_COMPLETE ? 0 : -1;
+		}
+		while (length + padding > 0) {
+			if (cgiStreamFill(stream, 1))
+				return -1;
+			n = stream->end - stream->start;
+			if (length > 0) {
+				if (n > length)
+					n = length;
+				if (type == FCGI_STDOUT && cgiReplyData(reply, stream->data + stream->start, n, stream->end - stream->start > n))
+					return -1;
+				#if LOG_LEVEL > 2
+				if (type == FCGI_STDERR)
+					Log(reply->socket, "FCGI stderr: %.*s", n, stream->data + stream->start);
+				#endif
+				length -= n;
+			} else {
+				if (n > padding)
+					n = padding;
+				padding -= n;
+			}
+			stream->start += n;
+		}
+	}
+}
+
+// Pass a CGI request to the responder and relay its reply to the client.
+// Returns true on error; the reply is incomplete then, or, if reply->sent
+// is still 0, the client has not received anything yet.
+
+boolean fastcgiRequest(const StringPool* env, CgiBody* body, CgiReply* reply) {
+	char requestBuf[HTTP_HEADER_LENGTH + 2048];
+	MemPool request = { sizeof(requestBuf), 0, requestBuf };
+	CgiStream stream;
+	const off_t length = body->remaining;
+	boolean pooled;
+	int rc;
+
+	if (fastcgiRequestEncode(&request, env))
+		return true;
+	do {
+		if ((stream.fd = fastcgiConnect(&pooled)) < 0)
+			return true;
+		stream.start = stream.end = 0;
+		rc = cgiWrite(stream.fd, requestBuf, request.current) ? 1 : fastcgiStdin(stream.fd, body) ? -1 : fastcgiRelay(&stream, reply);
+		if (rc == 0)
+			fastcgiRelease(stream.fd);
+		else
+			close(stream.fd);
+	} while (rc == 1 && pooled && body->remaining == length); // no retry once the body has been consumed
+	return rc != 0 || cgiReplyEnd(reply);
+}
+
+#endif
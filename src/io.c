@@ -20,9 +20,6 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "mrhttpd.h"
 
-#define RECEIVE_TIMEOUT 30
-#define SEND_TIMEOUT 5
-
 void setTimeout(const int socket) {
 	struct timeval timeout;
 
@@ -35,16 +32,51 @@ void setTimeout(const int socket) {
 	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 }
 
-int parseHeader(const int socket, MemPool* buffer, StringPool* headerPool) {
+#ifdef EVENT_MODEL_EPOLL
+
+// Sockets are non-blocking in the epoll event model. In a loop thread the
+// send functions queue what the socket cannot take right away, see event.c.
+// Elsewhere, instead of failing with EAGAIN, wait for the socket to become
+// ready, applying the same timeouts that setTimeout() would apply to a
+// blocking socket.
+
+boolean awaitSocket(const int socket, const short events) {
+	struct pollfd pfd;
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		return false; // genuine error
+	pfd.fd = socket;
+	pfd.events = events;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 1000 * ((events & POLLIN) ? RECEIVE_TIMEOUT : SEND_TIMEOUT)) > 0;
+}
+
+#endif
+
+int parseHeader(const int socket, MemPool* buffer, StringPool* headerPool, HeaderIndex* headerIndex) {
 	ssize_t received;
 	int cursor;
+	int scanned = 0; // line break search resumes here after a partial recv
 	int delim;
 	int rejectCurrent = 0;
+	#ifdef METRICS_PATH
+	struct timespec start = { 0, 0 }; // first byte of the request
+	#endif
 
 	stringPoolReset(headerPool);
+	headerIndexReset(headerIndex);
+
+	if (buffer->current > 0) {
+		#ifdef METRICS_PATH
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		#endif
+		cursor = 0;
+		goto _nextHeaderLine; // parse the overspill of the previous request first
+	}
 
 _startHeader:
 	memPoolReset(buffer);
+	scanned = 0;
 
 _moreHeader:
 	#if DEBUG & 8
@@ -59,6 +91,10 @@ _moreHeader:
 		return -1; // socket timeout
 	}
 	if (received < 0) {
+		#ifdef EVENT_MODEL_EPOLL
+		if (awaitSocket(socket, POLLIN))
+			goto _moreHeader;
+		#endif
 		#if DEBUG & 8
 		Log(socket, "parseHeader: recv error. received=%d, errno=%d", received, errno);
 		#endif
@@ -67,17 +103,22 @@ _moreHeader:
 	#if DEBUG & 8
 	Log(socket, "parseHeader: recv OK. received=%d", received);
 	#endif
+	#ifdef METRICS_PATH
+	if (start.tv_sec == 0)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	#endif
 	buffer->current += received;
 	cursor = 0; // cursor positioned on beginning of line
 
 _nextHeaderLine:
 	if (cursor >= buffer->current)
 		goto _startHeader; // buffer exhausted, read more data
-	delim = memPoolLineBreak(buffer, cursor); // search for end of line
+	delim = memPoolLineBreak(buffer, scanned > cursor ? scanned : cursor); // search for end of line
 	#if DEBUG & 16
 	Log(socket, "parseHeader: parser loop iteration. cursor=%d, delim=%d, end=%d", cursor, delim, buffer->current);
 	#endif
 	if (delim < 0) { // end of line not found
+		scanned = buffer->current - 1; // the last byte may be the '\r' of a line break
 		if (rejectCurrent) {
 			#if DEBUG & 32
 			Log(socket, "parseHeader: reject buffer with length: %d", buffer->current);
@@ -89,6 +130,7 @@ _nextHeaderLine:
 			Log(socket, "parseHeader: move buffer by: %d", cursor);
 			#endif
 			buffer->current -= cursor;
+			scanned -= cursor;
 			memmove(buffer->mem, buffer->mem + cursor, buffer->current);
 			goto _moreHeader;
 		}
@@ -129,9 +171,13 @@ _nextHeaderLine:
 			Log(socket, "parseHeader: skip header at index: %d", cursor);
 			#endif
 		}
-		#if DEBUG & 32
-		else { Log(socket, "parseHeader: recorded header at index: %d", cursor); }
-		#endif
+		else {
+			if (headerPool->current > 1) // not the request line
+				headerIndexAdd(headerIndex, headerPool->strings[headerPool->current - 1]);
+			#if DEBUG & 32
+			Log(socket, "parseHeader: recorded header at index: %d", cursor);
+			#endif
+		}
 		cursor = delim + 2; // beginning of next line
 		goto _nextHeaderLine; // find next line in buffer
 	}
@@ -151,22 +197,37 @@ _nextHeaderLine:
 		Log(socket, "parseHeader: spot landing (no overspill).");
 		#endif
 	}
+	#ifdef METRICS_PATH
+	if (headerPool->current > 0)
+		metricsRequestBegin(&start);
+	#endif
 
 	return headerPool->current; // 0 indicates an error: request line not found
 }
 
-ssize_t sendMemPool(const int socket, const MemPool* mp) {
-	return sendBuffer(socket, mp->mem, mp->current);
+// With MSG_MORE among the flags the data is held back until more follows,
+// e.g. a reply header preceding sendfile(), or the reply to a pipelined request.
+
+ssize_t sendMemPool(const int socket, const MemPool* mp, const int flags) {
+	return sendBufferFlags(socket, mp->mem, mp->current, flags);
 }
 
 ssize_t sendBuffer(const int socket, const char* buf, const ssize_t count) {
+	return sendBufferFlags(socket, buf, count, 0);
+}
+
+ssize_t sendBufferFlags(const int socket, const char* buf, const ssize_t count, const int flags) {
 	ssize_t totalSent = 0, sent;
 
+	#ifdef EVENT_MODEL_EPOLL
+	if (eventQueued(socket))
+		return eventQueue(socket, buf, count); // behind the output queued already
+	#endif
 	while (totalSent < count) {
 		#if DEBUG & 2
 		Log(socket, "sendBuffer: loop iteration.");
 		#endif
-		sent = send(socket, buf + totalSent, count - totalSent, MSG_NOSIGNAL);
+		sent = send(socket, buf + totalSent, count - totalSent, flags | MSG_NOSIGNAL);
 		if (sent == 0) {
 			#if DEBUG & 2
 			Log(socket, "sendBuffer: send strangeness. sent=%d", sent);
@@ -174,11 +235,20 @@ ssize_t sendBuffer(const int socket, const char* buf, const ssize_t count) {
 			return -1; // timeout
 		}
 		if (sent < 0) {
+			#ifdef EVENT_MODEL_EPOLL
+			if (eventLoopThread && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return eventQueue(socket, buf + totalSent, count - totalSent) < 0 ? -1 : count;
+			if (awaitSocket(socket, POLLOUT))
+				continue;
+			#endif
 			#if DEBUG & 2
 			Log(socket, "sendBuffer: send error. sent=%d, errno=%d", sent, errno);
 			#endif
 			return sent; // propagate error
 		}
+		#ifdef METRICS_PATH
+		metricsFirstByte();
+		#endif
 		totalSent += sent;
 		#if DEBUG & 2
 		Log(socket, "sendBuffer: inside loop. sent=%d", sent);
@@ -191,17 +261,77 @@ ssize_t sendBuffer(const int socket, const char* buf, const ssize_t count) {
 	return totalSent;
 }
 
+ssize_t sendVector(const int socket, struct iovec* iov, int count, const int flags) {
+	struct msghdr msg = { 0 };
+	ssize_t totalSent = 0, sent;
+	#ifdef EVENT_MODEL_EPOLL
+	ssize_t queued;
+
+	if (eventQueued(socket))
+		return eventQueueVector(socket, iov, count);
+	#endif
+	while (count > 0) {
+		#if DEBUG & 2
+		Log(socket, "sendVector: loop iteration.");
+		#endif
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		sent = sendmsg(socket, &msg, flags | MSG_NOSIGNAL);
+		if (sent == 0) {
+			#if DEBUG & 2
+			Log(socket, "sendVector: send strangeness. sent=%d", sent);
+			#endif
+			return -1; // timeout
+		}
+		if (sent < 0) {
+			#ifdef EVENT_MODEL_EPOLL
+			if (eventLoopThread && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return (queued = eventQueueVector(socket, iov, count)) < 0 ? -1 : totalSent + queued;
+			if (awaitSocket(socket, POLLOUT))
+				continue;
+			#endif
+			#if DEBUG & 2
+			Log(socket, "sendVector: send error. sent=%d, errno=%d", sent, errno);
+			#endif
+			return sent; // propagate error
+		}
+		#ifdef METRICS_PATH
+		metricsFirstByte();
+		#endif
+		totalSent += sent;
+		// skip the parts that have been sent completely, adjust a partly sent one
+		while (count > 0 && (size_t) sent >= iov->iov_len) {
+			sent -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char*) iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+
+	#if DEBUG & 2
+	Log(socket, "sendVector: return OK. totalSent=%d", totalSent);
+	#endif
+	return totalSent;
+}
+
 #if USE_SENDFILE == 1
 
-ssize_t sendFile(const int socket, const int fd, const ssize_t count) {
+ssize_t sendFile(const int socket, const int fd, off_t offset, const ssize_t count) {
 	ssize_t totalSent = 0, sent;
 
+	#ifdef EVENT_MODEL_EPOLL
+	if (eventQueued(socket))
+		return eventQueueFile(socket, fd, offset, count);
+	#endif
 	while (totalSent < count) {
 		#if DEBUG & 2
 		Log(socket, "sendFile: loop iteration.");
 		#endif
 
-		sent = sendfile(socket, fd, null, count - totalSent);
+		sent = sendfile(socket, fd, &offset, count - totalSent); // the file position is left alone, the descriptor may be shared
 		if (sent == 0) {
 			#if DEBUG & 2
 			Log(socket, "sendFile: pipe strangeness. sent=%d", sent);
@@ -209,6 +339,12 @@ ssize_t sendFile(const int socket, const int fd, const ssize_t count) {
 			return -1; // timeout
 		}
 		if (sent < 0 ) {
+			#ifdef EVENT_MODEL_EPOLL
+			if (eventLoopThread && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return eventQueueFile(socket, fd, offset, count - totalSent) < 0 ? -1 : count;
+			if (awaitSocket(socket, POLLOUT))
+				continue;
+			#endif
 			#if DEBUG & 2
 			Log(socket, "sendFile: pipe error. sent=%d, errno=%d", sent, errno);
 			#endif
@@ -217,6 +353,9 @@ ssize_t sendFile(const int socket, const int fd, const ssize_t count) {
 		#if DEBUG & 2
 		Log(socket, "sendFile: inside loop. sent=%d", sent);
 		#endif
+		#ifdef METRICS_PATH
+		metricsFirstByte();
+		#endif
 		totalSent += sent;
 	}
 
@@ -228,7 +367,7 @@ ssize_t sendFile(const int socket, const int fd, const ssize_t count) {
 
 #else
 
-ssize_t sendFile(const int socket, const int fd, const ssize_t count) {
+ssize_t sendFile(const int socket, const int fd, off_t offset, const ssize_t count) {
 	char buf[16384];
 	ssize_t received, sent;
 	ssize_t totalReceived = 0, totalSent = 0;
@@ -238,7 +377,7 @@ ssize_t sendFile(const int socket, const int fd, const ssize_t count) {
 	#endif
 	while (totalReceived < count) {
 		int toBeRead = count - totalReceived;
-		received = read(fd, buf, toBeRead >= sizeof(buf) ? sizeof(buf) : toBeRead);
+		received = pread(fd, buf, toBeRead >= sizeof(buf) ? sizeof(buf) : toBeRead, offset + totalReceived);
 		if (received == 0) {
 			#if DEBUG & 2
 			Log(socket, "pipeToSocket: side exit. totalReceived=%d, totalSent=%d", totalReceived, totalSent);
@@ -269,6 +408,78 @@ ssize_t sendFile(const int socket, const int fd, const ssize_t count) {
 
 #endif
 
+#ifdef CGI_PATH
+
+// Move count bytes, which the pipe holds already, to the socket without
+// copying them to user space. MSG_MORE in flags translates to SPLICE_F_MORE.
+
+ssize_t pipeToSocket(const int socket, const int fd, const ssize_t count, const int flags) {
+	ssize_t totalSent = 0, sent;
+
+	while (totalSent < count) {
+		sent = splice(fd, null, socket, null, count - totalSent, SPLICE_F_MOVE | (flags & MSG_MORE ? SPLICE_F_MORE : 0));
+		if (sent == 0) {
+			#if DEBUG & 2
+			Log(socket, "pipeToSocket: pipe strangeness. sent=%d", sent);
+			#endif
+			return -1; // the pipe was drained by someone else
+		}
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			#ifdef EVENT_MODEL_EPOLL
+			if (awaitSocket(socket, POLLOUT))
+				continue;
+			#endif
+			#if DEBUG & 2
+			Log(socket, "pipeToSocket: splice error. sent=%d, errno=%d", sent, errno);
+			#endif
+			return sent; // propagate error
+		}
+		#ifdef METRICS_PATH
+		metricsFirstByte();
+		#endif
+		totalSent += sent;
+	}
+
+	#if DEBUG & 2
+	Log(socket, "pipeToSocket: return OK. totalSent=%d", totalSent);
+	#endif
+	return totalSent;
+}
+
+// Move up to count bytes of a request body from the socket to the pipe of a
+// CGI program without copying them to user space, and without waiting for
+// either of them. Returns the number of bytes moved, 0 if the socket has no
+// data for now, or -1 on error. errno is EAGAIN if the pipe is full.
+
+ssize_t socketToPipe(const int socket, const int fd, const ssize_t count) {
+	struct pollfd pfd = { socket, POLLIN, 0 };
+	ssize_t received;
+
+	// a blocking socket would wait in splice(), so look first
+	if (poll(&pfd, 1, 0) < 0)
+		return errno == EINTR ? 0 : -1;
+	if (pfd.revents == 0)
+		return 0;
+	do
+		received = splice(socket, null, fd, null, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	while (received < 0 && errno == EINTR);
+	if (received == 0) {
+		#if DEBUG & 2
+		Log(socket, "socketToPipe: side exit.");
+		#endif
+		return -1; // the client gave up
+	}
+	#if DEBUG & 2
+	if (received < 0)
+		Log(socket, "socketToPipe: splice error. received=%d, errno=%d", received, errno);
+	#endif
+	return received;
+}
+
+#endif
+
 #ifdef PUT_PATH
 
 ssize_t pipeToFile(const int socket, const int fd, const ssize_t count) {
@@ -289,6 +500,10 @@ ssize_t pipeToFile(const int socket, const int fd, const ssize_t count) {
 			return totalSent;
 		}
 		if (received < 0) {
+			#ifdef EVENT_MODEL_EPOLL
+			if (awaitSocket(socket, POLLIN))
+				continue;
+			#endif
 			#if DEBUG & 2
 			Log(socket, "pipeToFile: recv error. received=%d, errno=%d", received, errno);
 			#endif
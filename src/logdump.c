@@ -0,0 +1,139 @@
+/*
+
+mrhttpd-logdump - convert the binary access log of mrhttpd to text
+
+mrhttpd v2.8.0
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+// Usage: mrhttpd-logdump [-t | -c | -j] [file]
+//
+//   -t  text, one line per request (default)
+//   -c  CSV with a header line
+//   -j  JSON, one object per line
+//
+// The file defaults to ACCESS_LOG_FILE. A log that is still being written
+// can be dumped, too; records not completed yet are skipped.
+
+#include "config.h"
+#include "accesslog.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define null ((void*) 0L)
+
+typedef enum { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON } Format;
+
+const char* methodName[] = { "GET", "HEAD", "PUT", "DELETE", "POST" };
+
+// The path of a record, printable and safe for CSV and JSON
+
+void printPath(const AccessRecord* record) {
+	int i;
+
+	for (i = 0; i < sizeof(record->path) && record->path[i] != '\0'; i++) {
+		unsigned char c = record->path[i];
+		if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\' || c == ',')
+			printf("%%%02X", c);
+		else
+			putchar(c);
+	}
+}
+
+void printRecord(const AccessRecord* record, const Format format) {
+	char client[INET_ADDRSTRLEN];
+	char date[32];
+	time_t seconds = record->time / 1000000;
+	struct tm tm;
+
+	inet_ntop(AF_INET, &record->client, client, sizeof(client));
+	localtime_r(&seconds, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+	const char* method = record->method < sizeof(methodName) / sizeof(methodName[0]) ? methodName[record->method] : "?";
+	switch (format) {
+	case FORMAT_TEXT:
+		printf("%s.%06u  %15s  %3u  %-6s  %10llu  %8u us  %08x  ", date, (unsigned) (record->time % 1000000), client,
+			record->status, method, (unsigned long long) record->bytes, record->duration, record->pathHash);
+		printPath(record);
+		break;
+	case FORMAT_CSV:
+		printf("%s.%06u,%s,%u,%s,%llu,%u,%08x,", date, (unsigned) (record->time % 1000000), client,
+			record->status, method, (unsigned long long) record->bytes, record->duration, record->pathHash);
+		printPath(record);
+		break;
+	case FORMAT_JSON:
+		printf("{\"time\":%llu,\"client\":\"%s\",\"status\":%u,\"method\":\"%s\",\"bytes\":%llu,\"duration\":%u,\"pathHash\":\"%08x\",\"path\":\"",
+			(unsigned long long) record->time, client, record->status, method, (unsigned long long) record->bytes, record->duration, record->pathHash);
+		printPath(record);
+		putchar('"');
+		putchar('}');
+		break;
+	}
+	putchar('\n');
+}
+
+int main(int argc, char** argv) {
+	Format format = FORMAT_TEXT;
+	const char* fileName = null;
+	AccessRecord record;
+	FILE* file;
+	int i;
+
+	for (i = 1; i < argc; i++)
+		if (!strcmp(argv[i], "-t"))
+			format = FORMAT_TEXT;
+		else if (!strcmp(argv[i], "-c"))
+			format = FORMAT_CSV;
+		else if (!strcmp(argv[i], "-j"))
+			format = FORMAT_JSON;
+		else if (argv[i][0] != '-' && fileName == null)
+			fileName = argv[i];
+		else {
+			fputs("Usage: mrhttpd-logdump [-t | -c | -j] [file]\n", stderr);
+			return 2;
+		}
+	#ifdef ACCESS_LOG_FILE
+	if (fileName == null)
+		fileName = ACCESS_LOG_FILE;
+	#endif
+	if (fileName == null) {
+		fputs("mrhttpd-logdump: no file given and no ACCESS_LOG_FILE configured\n", stderr);
+		return 2;
+	}
+	file = fopen(fileName, "r");
+	if (file == null) {
+		perror(fileName);
+		return 1;
+	}
+
+	if (format == FORMAT_CSV)
+		puts("time,client,status,method,bytes,duration,pathHash,path");
+	while (fread(&record, sizeof(record), 1, file) == 1) {
+		if (record.time == 0)
+			continue; // never written
+		if (record.version != ACCESS_LOG_VERSION) {
+			fprintf(stderr, "mrhttpd-logdump: unknown record version %u\n", record.version);
+			return 1;
+		}
+		printRecord(&record, format);
+	}
+	fclose(file);
+	return 0;
+}
@@ -24,13 +24,19 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 int masterFd;
 
+#if LISTEN_SHARDS > 1
+int shardFd[LISTEN_SHARDS];
+cpu_set_t processCpuSet; // the CPUs the process may run on, empty if unknown
+#endif
+
 char* authHeader;
 int authMethods;
 
+sem_t shutDownRequest;                    // posted by the signal handlers
+volatile sig_atomic_t shutDownSignal = 0;
+
 int main(void) {
 	int rc;
-	int newFd;
-	struct sockaddr_in localAddress;
 	struct passwd *pw;
 	pthread_t threadId;
 
@@ -54,35 +60,20 @@ int main(void) {
 	#endif
 
 	// Obtain master listen socket
-	if ((masterFd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		puts("Could not create a socket, exiting");
-		exit(1);
-	}
-
-	// Allow re-use of port & address
-	rc = 1;
-	setsockopt(masterFd, SOL_SOCKET, SO_REUSEADDR, (void*) &rc, sizeof(rc));
+	masterFd = listenSocket();
 
-	localAddress.sin_family = AF_INET;
-	localAddress.sin_port = htons(SERVER_PORT);
-	localAddress.sin_addr.s_addr = INADDR_ANY;
-	memset(&(localAddress.sin_zero), 0, sizeof(localAddress.sin_zero));
-
-	if (bind(masterFd, (struct sockaddr* ) &localAddress, sizeof(struct sockaddr)) < 0) {
-		puts("Could not bind to port, exiting");
-		exit(1);
-	}
-
-	if (listen(masterFd, LISTEN_QUEUE_LENGTH) < 0) {
-		puts("Could not listen on port, exiting");
-		exit(1);
-	}
+	#if LISTEN_SHARDS > 1
+	// Obtain further listen sockets sharing the port with the master socket
+	shardFd[0] = masterFd;
+	for (rc = 1; rc < LISTEN_SHARDS; rc++)
+		shardFd[rc] = listenSocket();
+	#endif
 
 	// Set up signal handlers
+	sem_init(&shutDownRequest, 0, 0);
 	signal(SIGTERM, sigTermHandler);
 	signal(SIGINT,  sigIntHandler);
 	signal(SIGHUP,  sigHupHandler);
-	signal(SIGCHLD, sigChldHandler);
 
 	// Ignore SIGPIPE which can be thrown by sendfile()
 	signal(SIGPIPE, SIG_IGN);
@@ -131,6 +122,26 @@ int main(void) {
 	}
 	#endif
 
+	if (!mimeTypesInit()) {
+		puts("Could not read mime types, exiting");
+		exit(1);
+	}
+
+	#ifdef ACCESS_LOG_FILE
+	if (!accessLogOpen()) {
+		puts("Could not open access log, exiting");
+		exit(1);
+	}
+	#endif
+
+	#ifdef PRIVATE_DIR
+	// Read the status pages before dropping privileges
+	if (!errorPagesInit()) {
+		puts("Could not load error pages, exiting");
+		exit(1);
+	}
+	#endif
+
 	fclose(stderr);
 	fclose(stdin);
 
@@ -140,19 +151,174 @@ int main(void) {
 	setuid(pw->pw_uid);
 	#endif
 
+	#if FILE_CACHE_ENTRIES > 0
+	fileCacheInit();
+	#endif
+
+	#if COMPRESS_CACHE_ENTRIES > 0
+	compressCacheInit();
+	#endif
+
+	// A signal received before is taken care of right away
+	if (pthread_create(&threadId, null, shutDownThread, null)) {
+		puts("Could not start shutdown thread, exiting");
+		exit(1);
+	}
+
+	#ifdef CGI_PATH
+	if (!reaperInit()) {
+		puts("Could not start reaper thread, exiting");
+		exit(1);
+	}
+	#endif
+
+	#ifdef EVENT_MODEL_EPOLL
+	if (!eventInit()) {
+		puts("Could not start event loops, exiting");
+		exit(1);
+	}
+	#elif WORKER_THREADS > 0
+	if (!poolInit()) {
+		puts("Could not start worker threads, exiting");
+		exit(1);
+	}
+	#endif
+
+	#if LISTEN_SHARDS > 1
+	// The accept threads are spread over the CPUs of the process' cpuset
+	if (sched_getaffinity(0, sizeof(processCpuSet), &processCpuSet)) {
+		#if (LOG_LEVEL > 0) || (DEBUG > 0)
+		Log(masterFd, "Could not obtain CPU affinity, errno=%d", errno);
+		#endif
+		CPU_ZERO(&processCpuSet);
+	}
+	// One accept thread per shard, the main thread takes care of shard 0
+	for (rc = 1; rc < LISTEN_SHARDS; rc++)
+		if (pthread_create(&threadId, null, acceptThread, (void*) (long) rc)) {
+			puts("Could not start accept threads, exiting");
+			exit(1);
+		}
+	acceptThread((void*) 0L);
+	#else
+	acceptLoop(masterFd);
+	#endif
+}
+
+int listenSocket(void) {
+	int fd, rc;
+	struct sockaddr_in localAddress;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		puts("Could not create a socket, exiting");
+		exit(1);
+	}
+
+	// Allow re-use of port & address
+	rc = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*) &rc, sizeof(rc));
+
+	// Replies are coalesced via MSG_MORE already, Nagle's algorithm would only
+	// hold back the last segment of a burst of pipelined replies until the
+	// client acknowledges the previous one, which a client may delay by 40 ms.
+	// Accepted sockets inherit the option.
+	rc = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*) &rc, sizeof(rc));
+
+	#if LISTEN_SHARDS > 1
+	// Several sockets share the port, the kernel distributes new connections
+	rc = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*) &rc, sizeof(rc)) < 0) {
+		puts("Could not share port, exiting");
+		exit(1);
+	}
+	#endif
+
+	localAddress.sin_family = AF_INET;
+	localAddress.sin_port = htons(SERVER_PORT);
+	localAddress.sin_addr.s_addr = INADDR_ANY;
+	memset(&(localAddress.sin_zero), 0, sizeof(localAddress.sin_zero));
+
+	if (bind(fd, (struct sockaddr* ) &localAddress, sizeof(struct sockaddr)) < 0) {
+		puts("Could not bind to port, exiting");
+		exit(1);
+	}
+
+	// Note: with shards the queue length applies to every shard
+	if (listen(fd, LISTEN_QUEUE_LENGTH) < 0) {
+		puts("Could not listen on port, exiting");
+		exit(1);
+	}
+
+	return fd;
+}
+
+#if LISTEN_SHARDS > 1
+
+void* acceptThread(void* arg) {
+	const int shard = (int) (long) arg; // Non-portable kludge to implement call-by-value
+	const int cpuCount = CPU_COUNT(&processCpuSet);
+	cpu_set_t cpuSet;
+	int cpu, n, rc;
+
+	// Pin the accept thread to the n-th CPU of the process.
+	// Threads created by the accept thread are given the full set again,
+	// see acceptLoop().
+	if (cpuCount > 0) {
+		for (cpu = 0, n = shard % cpuCount; !CPU_ISSET(cpu, &processCpuSet) || n-- > 0; cpu++)
+			;
+		CPU_ZERO(&cpuSet);
+		CPU_SET(cpu, &cpuSet);
+		if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet)) != 0) {
+			#if (LOG_LEVEL > 0) || (DEBUG > 0)
+			Log(shardFd[shard], "Could not pin accept thread for shard %d to CPU %d, rc=%d", shard, cpu, rc);
+			#endif
+		}
+	}
+
+	#if DEBUG & 4
+	Log(shardFd[shard], "Accept thread starting for shard %d", shard);
+	#endif
+
+	acceptLoop(shardFd[shard]);
+	return null;
+}
+
+#endif
+
+void acceptLoop(const int listenFd) {
+	int newFd;
+	#if !defined(EVENT_MODEL_EPOLL) && WORKER_THREADS == 0
+	pthread_t threadId;
+	pthread_attr_t threadAttr;
+
+	pthread_attr_init(&threadAttr);
+	#if LISTEN_SHARDS > 1
+	// Connection threads may run on any CPU, not just on that of the accept thread
+	if (CPU_COUNT(&processCpuSet) > 0)
+		pthread_attr_setaffinity_np(&threadAttr, sizeof(processCpuSet), &processCpuSet);
+	#endif
+	#endif
+
 	// Server loop - exit only via signal handler
 	for (;;) {
 		#if DEBUG & 4
-		Log(masterFd, "Accept");
+		Log(listenFd, "Accept");
 		#endif
-		newFd = accept(masterFd, null, null);
+		newFd = accept(listenFd, null, null);
 		#if DEBUG & 4
-		Log(masterFd, "New connection for socket %d", newFd);
+		Log(listenFd, "New connection for socket %d", newFd);
 		#endif
 		if (newFd >= 0) {
+			#ifdef EVENT_MODEL_EPOLL
+			// Hand the socket over to an event loop
+			eventDispatch(newFd);
+			#elif WORKER_THREADS > 0
+			// Queue the socket for the next idle worker thread
+			poolDispatch(newFd);
+			#else
 			// Spawn thread to handle new socket
 			// The cast is a non-portable kludge to implement call-by-value
-			if (pthread_create(&threadId, null, serverThread, (void*) (long) newFd)) {
+			if (pthread_create(&threadId, &threadAttr, serverThread, (void*) (long) newFd)) {
 				// Creation of thread failed - 
 				// most likely due to thread overload.
 				//
@@ -165,9 +331,10 @@ int main(void) {
 				//
 				close(newFd);
 				#if DEBUG & 128
-				Log(masterFd, "Creation of worker thread failed for socket %d", newFd);
+				Log(listenFd, "Creation of worker thread failed for socket %d", newFd);
 				#endif
 			}
+			#endif
 		}
 	}
 }
@@ -176,71 +343,86 @@ void* serverThread(void* arg) {
 	// Detach thread - it will terminate on its own
 	pthread_detach(pthread_self());
 
-	const int socket = (int) (long) arg; // Non-portable kludge to implement call-by-value;
+	serveConnection((int) (long) arg); // Non-portable kludge to implement call-by-value
+
+	return null;
+}
+
+void serveConnection(const int socket) {
+	char streamBuf[HTTP_HEADER_LENGTH];
+	MemPool stream = { sizeof(streamBuf), 0, streamBuf }; // carries pipelined requests from one call to the next
 
 	#if DEBUG & 1
 	Log(socket, "Worker thread starting for socket %d", socket);
 	#endif
 	
 	setTimeout(socket);
+	#ifdef METRICS_PATH
+	metricsConnection(1);
+	#endif
 
-	while (httpRequest(socket) == CONNECTION_KEEPALIVE)
+	while (httpRequest(socket, &stream) == CONNECTION_KEEPALIVE)
 		;
 
 	// Do not shut down the socket as this will affect running cgi programs.
 	// Just close the file descriptor.
 	close(socket);
+	#ifdef METRICS_PATH
+	metricsConnection(-1);
+	#endif
 	
 	#if DEBUG & 1
 	Log(socket, "Worker thread finished for socket %d", socket);
 	#endif
-	
-	return null;
-}
-
-void reaper() {
-	// Clean up zombies
-	while(waitpid(-1, null, WNOHANG) > 0)
-		;
 }
 
-int shuttingDown = 0;
-
 void shutDownServer() {
-	if (!shuttingDown++) { // should be a mutex but hey
-		// Exit fairly gracefully
-		close(masterFd);
-		sleep(5); // Give threads a chance
-		#if (LOG_LEVEL > 0) || (DEBUG > 0)
-		LogClose(masterFd);
-		#endif
-		reaper();
-		exit(0);
-	}
+	// Exit fairly gracefully
+	#if LISTEN_SHARDS > 1
+	for (int shard = 1; shard < LISTEN_SHARDS; shard++)
+		close(shardFd[shard]);
+	#endif
+	close(masterFd);
+	sleep(5); // Give threads a chance
+	#if (LOG_LEVEL > 0) || (DEBUG > 0)
+	LogClose(masterFd);
+	#endif
+	#ifdef ACCESS_LOG_FILE
+	accessLogClose();
+	#endif
+	exit(0);
 }
 
-void sigTermHandler(const int signal) {
+// SIGTERM and SIGINT only post a semaphore, which is async-signal-safe.
+// The server is shut down by a thread of its own in normal context, where
+// it may log, wait for the log writer and exit.
+
+void* shutDownThread(void* arg) {
+	while (sem_wait(&shutDownRequest) != 0)
+		; // interrupted
 	#if (LOG_LEVEL > 0) || (DEBUG > 0)
-	Log(masterFd, "Terminating...");
+	Log(masterFd, shutDownSignal == SIGINT ? "Interrupt" : "Terminating...");
 	#endif
 	shutDownServer();
+	return null;
+}
+
+void sigTermHandler(const int signal) {
+	shutDownSignal = signal;
+	sem_post(&shutDownRequest);
 }
 
 void sigIntHandler(const int signal) {
-	#if (LOG_LEVEL > 0) || (DEBUG > 0)
-	Log(masterFd, "Interrupt");
-	#endif
-	shutDownServer();
+	shutDownSignal = signal;
+	sem_post(&shutDownRequest);
 }
 
 void sigHupHandler(const int signal) {
 	#if (LOG_LEVEL > 0) || (DEBUG > 0)
 	Log(masterFd, "Hangup");
 	#endif
-	reaper();
-}
-
-void sigChldHandler(const int signal) {
-	reaper();
+	#ifdef PRIVATE_DIR
+	errorPagesReload();
+	#endif
 }
 
@@ -43,6 +43,13 @@ void memPoolResetTo(MemPool* mp, int savePosition) {
 		mp->mem[savePosition - 1] = '\0';
 }
 
+// Drop the first count bytes, e.g. the part of a stream that has been processed
+
+void memPoolConsume(MemPool* mp, const int count) {
+	mp->current -= count;
+	memmove(mp->mem, mp->mem + count, mp->current);
+}
+
 int memPoolNextTarget(MemPool* mp) {
 	return mp->current == 0 ? 0 : mp->current - 1;
 }
@@ -91,22 +98,95 @@ boolean memPoolExtendChar(MemPool* mp, const char c) {
 }
 
 boolean memPoolExtendNumber(MemPool* mp, const unsigned num) {
-	return num < 10 ? memPoolExtendChar(mp, digit[num]) : (memPoolExtendNumber(mp, num / 10 ) || memPoolExtendChar(mp, digit[num % 10]));
+	int current;
+
+	current = mp->current;
+	mp->current = memPoolNextTarget(mp);
+	if (memPoolAppendNumber(mp, num)) {
+		mp->current = current;
+		return true; // memory allocation failed
+	}
+	mp->current++; // include the null byte
+	return false; // success
 }
 
-void memPoolReplace(MemPool* mp, const char from, const char to) {
-	char* cp;
-	int i;
-	
-	for (cp = mp->mem, i = mp->current; i > 0; cp++, i--)
-		if (*cp == from)
-		  *cp = to;
+// Raw appending: slices of known length are concatenated without separators,
+// so the content of the pool is ready to be sent as is. A null byte is kept
+// behind the content, but it is not counted.
+
+boolean memPoolAppend(MemPool* mp, const char* data, const int length) {
+	if ((mp->current + length) >= mp->size)
+		return true; // memory allocation failed
+	memcpy(mp->mem + mp->current, data, length);
+	mp->current += length;
+	mp->mem[mp->current] = '\0';
+	return false; // success
+}
+
+boolean memPoolAppendNumber(MemPool* mp, unsigned long long num) {
+	char buf[24];
+	char* cp = buf + sizeof(buf);
+
+	do {
+		*--cp = digit[num % 10];
+		num /= 10;
+	} while (num > 0);
+	return memPoolAppend(mp, cp, buf + sizeof(buf) - cp);
 }
 
+boolean memPoolAppendHex(MemPool* mp, unsigned long long num) {
+	char buf[24];
+	char* cp = buf + sizeof(buf);
+
+	do {
+		*--cp = digit[num & 15];
+		num >>= 4;
+	} while (num > 0);
+	return memPoolAppend(mp, cp, buf + sizeof(buf) - cp);
+}
+
+// HTTP date as per RFC 1123, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+
+boolean memPoolAppendDate(MemPool* mp, const time_t t) {
+	struct tm tm;
+	char buf[32];
+
+	return memPoolAppend(mp, buf, strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&t, &tm)));
+}
+
+// Find the next "\r\n" at or after start. The vector loops compare a block
+// against '\r' and the same block shifted by one byte against '\n', so a
+// line break is found even if it straddles two blocks. The instruction set
+// is chosen at build time, the scalar loop finishes the remainder.
+
 int memPoolLineBreak(const MemPool* mp, const int start) {
-	int i;
-	
-	for (i = start; i < mp->current - 1; i++)
+	int i = start;
+
+	#ifdef __AVX2__
+	const __m256i cr32 = _mm256_set1_epi8('\r');
+	const __m256i lf32 = _mm256_set1_epi8('\n');
+	for (; i + 33 <= mp->current; i += 32) {
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (mp->mem + i)), cr32),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (mp->mem + i + 1)), lf32)));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	#endif
+
+	#ifdef __SSE2__
+	const __m128i cr16 = _mm_set1_epi8('\r');
+	const __m128i lf16 = _mm_set1_epi8('\n');
+	for (; i + 17 <= mp->current; i += 16) {
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (mp->mem + i)), cr16),
+			_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (mp->mem + i + 1)), lf16)));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	#endif
+
+	for (; i < mp->current - 1; i++)
 		if (mp->mem[i] == '\r' && mp->mem[i + 1] == '\n')
 			return i;
 	return -1;
@@ -171,22 +251,39 @@ boolean stringPoolAddVariables(StringPool* sp, const StringPool* var, const char
 
 }
 
-char* stringPoolReadHttpHeader(const StringPool* sp, const char* headerName) {
-	char** strp;
-	int i;
-	
-	for (strp = sp->strings, i = sp->current; i > 0; strp++, i--) {
-		char* value = removePrefix(headerName, *strp);
-		if (value != null && *value == ':')
-				return startOf(++value);
-	}
-	return null; // variable not found
+// Well-known request headers, indexed by HeaderId. Names in lower case.
+
+const Slice headerName[] = {
+	SLICE("connection"),
+	SLICE("authorization"),
+	SLICE("content-length"),
+	SLICE("range"),
+	SLICE("if-range"),
+	SLICE("if-modified-since"),
+	SLICE("if-none-match"),
+	SLICE("accept-encoding"),
+	SLICE("content-type")
+};
+
+void headerIndexReset(HeaderIndex* hi) {
+	memset(hi->value, 0, sizeof(hi->value));
 }
 
-char* removePrefix(const char* prefix, char* string) {
-	while (*prefix) {
-		if (*prefix++ != tolower(*string++)) // HTTP header names are case-insensitive according to RFC 2616
-			return null; // string does not start with prefix
-	}
-	return string; // remainder
+// Record the value of a header line if it belongs to a well-known header.
+// The first occurrence of a header wins.
+
+void headerIndexAdd(HeaderIndex* hi, char* line) {
+	char* colon;
+	int length, id;
+
+	colon = strchr(line, ':');
+	if (colon == null)
+		return; // not a header line
+	length = colon - line;
+	for (id = 0; id < HEADER_COUNT; id++)
+		if (headerName[id].length == length && !strncasecmp(line, headerName[id].text, length)) { // HTTP header names are case-insensitive according to RFC 2616
+			if (hi->value[id] == null)
+				hi->value[id] = startOf(colon + 1);
+			return;
+		}
 }
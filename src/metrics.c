@@ -0,0 +1,209 @@
+/*
+
+mrhttpd v2.8.0
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include "mrhttpd.h"
+
+#ifdef METRICS_PATH
+
+// Metrics
+
+// Counters and latency histograms are kept in METRICS_STRIPES stripes of a
+// cache line or more each. A thread sticks to one stripe, so threads do not
+// contend for the same cache lines, and updates are plain atomic additions
+// without any lock. Reading the metrics adds up all stripes; the result is
+// not an exact snapshot, which is fine for monitoring.
+
+// The histograms are log-linear in microseconds, in the manner of HDR
+// histograms: two buckets per power of two, with the upper bounds 1, 2, 3, 4,
+// 6, 8, 12, 16, ... and so forth up to 2^24 us, i.e. about 16.8 seconds.
+// Longer durations end up in an overflow bucket.
+
+#define METRICS_STRIPES 64
+#define METRICS_BUCKETS 48 // plus one for overflow
+
+typedef enum { METRIC_HEADER_PARSE, METRIC_FIRST_BYTE, METRIC_DURATION, METRICS } MetricId;
+
+typedef struct {
+	unsigned long bucket[METRICS_BUCKETS + 1];
+	unsigned long sum;        // microseconds
+} Histogram;
+
+typedef struct {
+	unsigned long requests[HTTP_METHODS][HTTP_CODES];
+	unsigned long bytes;      // reply bytes sent, header included
+	unsigned long fileBytes;  // thereof sent via sendFile()
+	unsigned long keepAlive;  // replies after which the connection was kept open
+	long connections;         // the difference of opened and closed ones
+	Histogram histogram[METRICS];
+} __attribute__((aligned(64))) MetricsStripe;
+
+const char* metricsMethodName[HTTP_METHODS] = { "GET", "HEAD", "PUT", "DELETE", "POST" };
+
+const struct {
+	const char* name;
+	const char* help;
+} metricsHistogram[METRICS] = {
+	{ "mrhttpd_header_parse_seconds", "Time from the first byte of a request to the end of its header." },
+	{ "mrhttpd_first_byte_seconds", "Time from the first byte of a request to the first byte of the reply." },
+	{ "mrhttpd_request_duration_seconds", "Time from the first byte of a request to the end of the reply." }
+};
+
+MetricsStripe metricsStripe[METRICS_STRIPES];
+unsigned metricsNextStripe = 0;
+
+__thread MetricsStripe* metricsOwnStripe = null;
+__thread struct timespec metricsStart; // first byte of the current request
+__thread boolean metricsAwaitFirstByte = false;
+
+MetricsStripe* metricsThreadStripe(void) {
+	if (metricsOwnStripe == null)
+		metricsOwnStripe = &metricsStripe[__atomic_fetch_add(&metricsNextStripe, 1, __ATOMIC_RELAXED) % METRICS_STRIPES];
+	return metricsOwnStripe;
+}
+
+int metricsBucket(unsigned long us) {
+	int k;
+
+	if (us <= 4)
+		return us == 0 ? 0 : us - 1;
+	us--;
+	k = 63 - __builtin_clzl(us); // floor(log2)
+	k = 2 * k + ((us >> (k - 1)) & 1);
+	return k < METRICS_BUCKETS ? k : METRICS_BUCKETS;
+}
+
+unsigned long metricsBucketBound(const int bucket) {
+	if (bucket == 0)
+		return 1;
+	return bucket & 1 ? 1UL << (bucket / 2 + 1) : 3UL << (bucket / 2 - 1);
+}
+
+void metricsObserve(const MetricId metric, const struct timespec* since) {
+	Histogram* histogram = &metricsThreadStripe()->histogram[metric];
+	struct timespec now;
+	long us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+	if (us < 0)
+		us = 0;
+	__atomic_add_fetch(&histogram->bucket[metricsBucket(us)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&histogram->sum, us, __ATOMIC_RELAXED);
+}
+
+// Called by parseHeader() once a request header is complete
+
+void metricsRequestBegin(const struct timespec* start) {
+	metricsStart = *start;
+	metricsObserve(METRIC_HEADER_PARSE, start);
+	metricsAwaitFirstByte = true;
+}
+
+// Called by the send functions after every successful send
+
+void metricsFirstByte(void) {
+	if (metricsAwaitFirstByte) {
+		metricsAwaitFirstByte = false;
+		metricsObserve(METRIC_FIRST_BYTE, &metricsStart);
+	}
+}
+
+// Called by httpRequest() once the reply is complete
+
+void metricsRequest(const int method, const int status, const ssize_t bytes, const off_t fileBytes, const ConnectionState connectionState) {
+	MetricsStripe* stripe = metricsThreadStripe();
+
+	metricsAwaitFirstByte = false;
+	metricsObserve(METRIC_DURATION, &metricsStart);
+	__atomic_add_fetch(&stripe->requests[method][status], 1, __ATOMIC_RELAXED);
+	if (bytes > 0)
+		__atomic_add_fetch(&stripe->bytes, bytes, __ATOMIC_RELAXED);
+	if (fileBytes > 0)
+		__atomic_add_fetch(&stripe->fileBytes, fileBytes, __ATOMIC_RELAXED);
+	if (connectionState == CONNECTION_KEEPALIVE)
+		__atomic_add_fetch(&stripe->keepAlive, 1, __ATOMIC_RELAXED);
+}
+
+void metricsConnection(const int delta) {
+	__atomic_add_fetch(&metricsThreadStripe()->connections, delta, __ATOMIC_RELAXED);
+}
+
+unsigned long metricsSum(const unsigned long* first) {
+	const size_t offset = (const char*) first - (const char*) metricsStripe;
+	unsigned long sum = 0;
+	int i;
+
+	// the same field in all stripes
+	for (i = 0; i < METRICS_STRIPES; i++)
+		sum += __atomic_load_n((const unsigned long*) ((const char*) &metricsStripe[i] + offset), __ATOMIC_RELAXED);
+	return sum;
+}
+
+boolean metricsWriteCounter(FILE* file, const char* name, const char* help, const unsigned long value) {
+	return fprintf(file, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, value) < 0;
+}
+
+// Write the metrics in the Prometheus text format
+
+boolean metricsWrite(FILE* file) {
+	unsigned long count, total;
+	int method, status, metric, bucket;
+
+	if (fputs(
+		"# HELP mrhttpd_requests_total Requests served, by method and status code.\n"
+		"# TYPE mrhttpd_requests_total counter\n", file) < 0)
+		return true;
+	for (method = 0; method < HTTP_METHODS; method++)
+		for (status = 0; status < HTTP_CODES; status++)
+			if ((count = metricsSum(&metricsStripe[0].requests[method][status])) > 0 &&
+				fprintf(file, "mrhttpd_requests_total{method=\"%s\",code=\"%.3s\"} %lu\n",
+					metricsMethodName[method], httpStatusLine[status].text + 1, count) < 0)
+				return true;
+
+	if (
+		metricsWriteCounter(file, "mrhttpd_sent_bytes_total", "Reply bytes sent, headers included.", metricsSum(&metricsStripe[0].bytes)) ||
+		metricsWriteCounter(file, "mrhttpd_sendfile_bytes_total", "Reply bytes sent from files via sendfile.", metricsSum(&metricsStripe[0].fileBytes)) ||
+		metricsWriteCounter(file, "mrhttpd_keepalive_reuse_total", "Replies after which the connection was kept open for another request.", metricsSum(&metricsStripe[0].keepAlive)) ||
+		// a connection may be opened and closed in different stripes, only the sum makes sense
+		fprintf(file, "# HELP mrhttpd_connections Client connections currently open.\n# TYPE mrhttpd_connections gauge\nmrhttpd_connections %ld\n",
+			(long) metricsSum((unsigned long*) &metricsStripe[0].connections)) < 0
+	)
+		return true;
+
+	for (metric = 0; metric < METRICS; metric++) {
+		const char* name = metricsHistogram[metric].name;
+		if (fprintf(file, "# HELP %s %s\n# TYPE %s histogram\n", name, metricsHistogram[metric].help, name) < 0)
+			return true;
+		for (bucket = 0, total = 0; bucket < METRICS_BUCKETS; bucket++) {
+			unsigned long bound = metricsBucketBound(bucket);
+			total += metricsSum(&metricsStripe[0].histogram[metric].bucket[bucket]);
+			if (fprintf(file, "%s_bucket{le=\"%lu.%06lu\"} %lu\n", name, bound / 1000000, bound % 1000000, total) < 0)
+				return true;
+		}
+		total += metricsSum(&metricsStripe[0].histogram[metric].bucket[METRICS_BUCKETS]);
+		count = metricsSum(&metricsStripe[0].histogram[metric].sum);
+		if (fprintf(file, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %lu.%06lu\n%s_count %lu\n",
+				name, total, name, count / 1000000, count % 1000000, name, total) < 0)
+			return true;
+	}
+	return false;
+}
+
+#endif
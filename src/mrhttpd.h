@@ -23,12 +23,16 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define MRHTTPD_INCLUDE
 
 #define _REENTRANT
+#define _GNU_SOURCE
 
 #include "config.h"
+#include "accesslog.h"
 
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,11 +43,18 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <poll.h>
+#include <semaphore.h>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #ifdef EXT_FILE_CMD
 #include <unistd.h>
@@ -57,12 +68,50 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <sys/sendfile.h>
 #endif
 
+
+#if COMPRESS_CACHE_ENTRIES > 0 || defined(ACCESS_LOG_FILE)
+#include <sys/mman.h>
+#endif
+
+#ifdef FASTCGI_SOCKET
+#include <sys/un.h>
+#endif
+
+#if defined(CGI_PATH) || defined(EXT_FILE_CMD)
+#include <spawn.h>
+#endif
+
+#ifdef CGI_PATH
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/pidfd.h>
+#endif
+
+#if WORKER_THREADS > 0
+#include <sys/epoll.h>
+#endif
+
+#ifdef EVENT_MODEL_EPOLL
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#endif
+
 #define SERVER_NAME       "mrhttpd"
 #define SERVER_SOFTWARE   "mrhttpd/2.8.0"
 
 #define PROTOCOL_HTTP_1_0 "HTTP/1.0"
 #define PROTOCOL_HTTP_1_1 "HTTP/1.1"
 
+#define RECEIVE_TIMEOUT 30
+#define SEND_TIMEOUT 5
+#define LINGER_TIMEOUT 100 // ms, wait for the request of a rejected connection
+
+#define COMPRESS_MIN_SIZE 256     // smaller files are sent as they are
+#define COMPRESS_MAX_SIZE 4194304 // larger files are sent as they are
+
 typedef enum { false, true } boolean;
 
 typedef enum { CONNECTION_KEEPALIVE, CONNECTION_CLOSE } ConnectionState;
@@ -80,54 +129,288 @@ typedef struct {
 	MemPool* mp;
 } StringPool;
 
+typedef struct {
+	const char* text;
+	int length;
+} Slice; // constant string of known length
+
+#define SLICE(s) { s, sizeof(s) - 1 }
+
+typedef enum {
+	HEADER_CONNECTION,
+	HEADER_AUTHORIZATION,
+	HEADER_CONTENT_LENGTH,
+	HEADER_RANGE,
+	HEADER_IF_RANGE,
+	HEADER_IF_MODIFIED_SINCE,
+	HEADER_IF_NONE_MATCH,
+	HEADER_ACCEPT_ENCODING,
+	HEADER_CONTENT_TYPE,
+	HEADER_COUNT
+} HeaderId;
+
+typedef struct {
+	char* value[HEADER_COUNT]; // value of a well-known request header, or null
+} HeaderIndex;
+
+enum HttpMethod {
+	HTTP_GET,
+	HTTP_HEAD,
+	HTTP_PUT,
+	HTTP_DELETE,
+	HTTP_POST,
+	HTTP_METHODS // number of methods
+};
+
+enum HttpCodeIndex {
+	HTTP_200,
+	HTTP_201,
+	HTTP_202,
+	HTTP_204,
+	HTTP_206,
+	HTTP_300,
+	HTTP_301,
+	HTTP_302,
+	HTTP_304,
+	HTTP_400,
+	HTTP_401,
+	HTTP_403,
+	HTTP_404,
+	HTTP_413,
+	HTTP_416,
+	HTTP_500,
+	HTTP_501,
+	HTTP_502,
+	HTTP_503,
+	HTTP_CODES // number of status codes
+};
+
+typedef struct {
+	unsigned hash;
+	int refCount;
+	time_t loaded;
+	int fd;
+	off_t size;
+	time_t modified;
+	ino_t inode;
+	int variants;             // precompressed sidecar files available, bitmask of encodings
+	int encoding;             // content coding of the file, or -1
+	char contentType[64];
+	char header[384];         // entity header lines, ready to be sent
+	int headerLength;
+	char name[256];           // cache key, may contain a NUL byte, see sidecarKey()
+	int nameLength;
+	char* response;           // small files only: header and body, or null
+	int responseHeaderLength;
+} FileEntry;
+
+typedef struct {
+	int socket;
+	const char* protocol;
+	ConnectionState connectionState; // as requested by the client, unless the body can only be delimited by closing
+	int flags;                       // for the last send of the reply, e.g. MSG_MORE
+	int statusCode;                  // index into httpStatusLine, for the logs
+	boolean headerDone;              // CGI header complete and translated
+	boolean chunked;                 // body in chunked transfer coding
+	boolean chunkOpen;               // the line break ending a spliced chunk is still owed
+	boolean discard;                 // no body to be sent, e.g. for HEAD requests
+	off_t remaining;                 // body bytes still to be sent if the length is known, or -1
+	ssize_t sent;
+	int cgiHeaderLength;
+	int replyHeaderLength;           // reply header pending, or 0
+	char cgiHeader[HTTP_HEADER_LENGTH];
+	char replyHeader[HTTP_HEADER_LENGTH + 256];
+} CgiReply;
+
+typedef struct {
+	int socket;
+	MemPool* stream;          // holds the beginning of the body, the overspill from parseHeader()
+	off_t remaining;          // body bytes not passed on yet
+} CgiBody;
+
+typedef struct {
+	int fd;                   // connected to a CGI server process
+	int start;                // of the data not consumed yet
+	int end;
+	char data[16384];
+} CgiStream;
+
 #define null ((void*) 0L)
 
+#ifndef MSG_MORE
+#define MSG_MORE 0 // Linux specific
+#endif
+
 // main.c
 
 extern char* authHeader;
 extern int authMethods;
 
 int main(void);
+int listenSocket(void);
+void acceptLoop(const int);
+#if LISTEN_SHARDS > 1
+void* acceptThread(void*);
+#endif
 void*serverThread(void*);
-void reaper();
+void serveConnection(const int);
 void shutDownServer();
+void* shutDownThread(void*);
 void sigTermHandler(const int);
 void sigIntHandler(const int);
 void sigHupHandler(const int);
-void sigChldHandler(const int);
+
+// accesslog.c
+
+#ifdef ACCESS_LOG_FILE
+boolean accessLogOpen(void);
+void accessLogClose(void);
+void accessLogWrite(const struct timespec*, const uint32_t, const int, const int, const uint64_t, const char*);
+#endif
+
+// cache.c
+
+#if FILE_CACHE_ENTRIES > 0
+void fileCacheInit(void);
+FileEntry* fileCacheGet(const char*, const int);
+FileEntry* fileCachePut(const char*, const int, const int, const struct stat*, const char*, const int, const int);
+void fileCacheRelease(FileEntry*);
+void fileCacheFlush(void);
+#endif
+
+// cgi.c
+
+#ifdef CGI_PATH
+void cgiReplyInit(CgiReply*, const int, const char*, const boolean, const ConnectionState, const int);
+boolean cgiReplyData(CgiReply*, const char*, int, const boolean);
+boolean cgiReplyEnd(CgiReply*);
+boolean cgiRequest(char*, StringPool*, CgiBody*, CgiReply*);
+boolean cgiWrite(const int, const char*, ssize_t);
+ssize_t cgiBodyRead(CgiBody*, char*, ssize_t);
+boolean cgiBodyWrite(CgiBody*, const int);
+boolean cgiStreamFill(CgiStream*, const int);
+#endif
+
+// compress.c
+
+#if COMPRESS_CACHE_ENTRIES > 0
+void compressCacheInit(void);
+int compressCacheGet(const char*, const struct stat*, struct stat*);
+int compressTemporary(const int, const struct stat*, struct stat*);
+#endif
+
+// event.c
+
+#ifdef EVENT_MODEL_EPOLL
+extern __thread boolean eventLoopThread;
+
+boolean eventInit(void);
+void eventDispatch(const int);
+boolean eventQueued(const int);
+ssize_t eventQueue(const int, const char*, const ssize_t);
+ssize_t eventQueueVector(const int, const struct iovec*, int);
+ssize_t eventQueueFile(const int, const int, const off_t, const ssize_t);
+#endif
+
+// fastcgi.c
+
+#ifdef FASTCGI_SOCKET
+boolean fastcgiRequest(const StringPool*, CgiBody*, CgiReply*);
+#endif
+
+// metrics.c
+
+#ifdef METRICS_PATH
+void metricsRequestBegin(const struct timespec*);
+void metricsFirstByte(void);
+void metricsRequest(const int, const int, const ssize_t, const off_t, const ConnectionState);
+void metricsConnection(const int);
+boolean metricsWrite(FILE*);
+#endif
+
+// pool.c
+
+#if WORKER_THREADS > 0
+boolean poolInit(void);
+void poolDispatch(const int);
+#endif
 
 // protocol.c
 
-ConnectionState httpRequest(const int);
+extern const Slice httpStatusLine[];
+extern const Slice connectionLine[];
+
+int httpCodeIndex(const int);
+
+boolean addEntityHeader(MemPool*, const off_t, const char*);
+boolean addETag(MemPool*, const struct stat*);
+boolean addValidatorHeader(MemPool*, const struct stat*);
+boolean addFileHeader(MemPool*, const off_t, const struct stat*, const char*, const int);
+#ifdef PRIVATE_DIR
+boolean errorPagesInit(void);
+void errorPagesReload(void);
+#endif
+ConnectionState httpRequest(const int, MemPool*);
+void httpServiceUnavailable(const int);
 
 // io.c
 
 void setTimeout(const int);
-int parseHeader(const int, MemPool*, StringPool*);
-ssize_t sendMemPool(const int, const MemPool*);
+#ifdef EVENT_MODEL_EPOLL
+boolean awaitSocket(const int, const short);
+#endif
+int parseHeader(const int, MemPool*, StringPool*, HeaderIndex*);
+ssize_t sendMemPool(const int, const MemPool*, const int);
 ssize_t sendBuffer(const int, const char* , const ssize_t);
-ssize_t sendFile(const int, const int, const ssize_t);
-ssize_t pipeToSocket(const int, const int, const ssize_t);
+ssize_t sendBufferFlags(const int, const char* , const ssize_t, const int);
+ssize_t sendVector(const int, struct iovec*, int, const int);
+ssize_t sendFile(const int, const int, off_t, const ssize_t);
+#ifdef CGI_PATH
+ssize_t pipeToSocket(const int, const int, const ssize_t, const int);
+ssize_t socketToPipe(const int, const int, const ssize_t);
+#endif
 ssize_t pipeToFile(const int, const int, const ssize_t);
 
 // mem.c
 
 void memPoolReset(MemPool*);
 void memPoolResetTo(MemPool*, int);
+void memPoolConsume(MemPool*, const int);
 int memPoolNextTarget(MemPool*);
 boolean memPoolAdd(MemPool*, const char*);
 boolean memPoolExtend(MemPool*, const char*);
 boolean memPoolExtendChar(MemPool*, const char);
 boolean memPoolExtendNumber(MemPool*, const unsigned);
-void memPoolReplace(MemPool*, const char, const char);
+boolean memPoolAppend(MemPool*, const char*, const int);
+boolean memPoolAppendNumber(MemPool*, unsigned long long);
+boolean memPoolAppendHex(MemPool*, unsigned long long);
+boolean memPoolAppendDate(MemPool*, const time_t);
+#define memPoolAppendLiteral(mp, s) memPoolAppend(mp, s, sizeof(s) - 1)
+#define memPoolAppendSlice(mp, s) memPoolAppend(mp, (s).text, (s).length)
 int memPoolLineBreak(const MemPool*, const int);
 void stringPoolReset(StringPool*);
 boolean stringPoolAdd(StringPool*, const char*);
 boolean stringPoolAddVariable(StringPool*, const char*, const char*);
 boolean stringPoolAddVariableNumber(StringPool*, const char*, const unsigned);
 boolean stringPoolAddVariables(StringPool*, const StringPool*, const char*);
-char* stringPoolReadHttpHeader(const StringPool*, const char*);
-char* removePrefix(const char*, char*);
+void headerIndexReset(HeaderIndex*);
+void headerIndexAdd(HeaderIndex*, char*);
+
+// scgi.c
+
+#if CGI_WORKERS > 0
+boolean scgiRequest(const char*, const time_t, const StringPool*, CgiBody*, CgiReply*);
+#endif
+
+// spawn.c
+
+#if defined(CGI_PATH) || defined(EXT_FILE_CMD)
+pid_t spawnProcess(const char*, char* const[], char* const[], const char*, const int, const int);
+#endif
+#ifdef CGI_PATH
+boolean reaperInit(void);
+void reaperAdd(const pid_t);
+#endif
 
 // util.c
 
@@ -137,6 +420,7 @@ extern FILE* logFile;
 char* strToLower(char*);
 char* strToUpper(char*);
 char* startOf(char*);
+boolean httpDateParse(const char*, time_t*);
 boolean fileWriteChar(FILE*, const char);
 boolean fileWriteNumber(FILE*, const unsigned);
 boolean fileWriteString(FILE*, const char*);
@@ -145,7 +429,11 @@ boolean fileWriteTimestampNow(FILE*);
 int hexDigit(const char);
 boolean urlDecode(char*);
 boolean fileNameEncode(const char*, char*, size_t);
+boolean mimeTypesInit(void);
+const char* mimeTypeBySuffix(const char*);
 const char* mimeType(const char*);
+const char* mimeTypeOfFile(const char*, const int, const struct stat*);
+boolean mimeCompressible(const char*);
 int LogOpen(const int);
 void LogClose(const int);
 void Log(const int, const char*, ...);
@@ -0,0 +1,239 @@
+/*
+
+mrhttpd v2.8.0
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include "mrhttpd.h"
+
+#if WORKER_THREADS > 0
+
+// Worker thread pool
+
+// A fixed number of worker threads is created at start-up. The accept loop
+// hands new sockets to the workers via a bounded ring buffer. The ring buffer
+// is a lock-free multi-producer multi-consumer queue: every cell carries a
+// sequence number telling producers and consumers whether it is their turn.
+// A semaphore counts the queued sockets so that idle workers can sleep.
+
+#define POOL_QUEUE_LENGTH 1024 // must be a power of 2
+
+typedef struct {
+	unsigned sequence;
+	int socket;
+} PoolCell;
+
+PoolCell poolCell[POOL_QUEUE_LENGTH];
+unsigned poolIn = 0;  // next cell to be filled
+unsigned poolOut = 0; // next cell to be emptied
+sem_t poolQueued;
+
+boolean poolEnqueue(const int socket) {
+	PoolCell* cell;
+	unsigned pos = __atomic_load_n(&poolIn, __ATOMIC_RELAXED);
+
+	for (;;) {
+		cell = &poolCell[pos & (POOL_QUEUE_LENGTH - 1)];
+		int diff = (int) (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&poolIn, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return false; // queue full
+		else
+			pos = __atomic_load_n(&poolIn, __ATOMIC_RELAXED);
+	}
+	cell->socket = socket;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+boolean poolDequeue(int* socket) {
+	PoolCell* cell;
+	unsigned pos = __atomic_load_n(&poolOut, __ATOMIC_RELAXED);
+
+	for (;;) {
+		cell = &poolCell[pos & (POOL_QUEUE_LENGTH - 1)];
+		int diff = (int) (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&poolOut, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return false; // queue empty, or the producer of this cell has not finished yet
+		else
+			pos = __atomic_load_n(&poolOut, __ATOMIC_RELAXED);
+	}
+	*socket = cell->socket;
+	__atomic_store_n(&cell->sequence, pos + POOL_QUEUE_LENGTH, __ATOMIC_RELEASE);
+	return true;
+}
+
+void* poolThread(void* arg) {
+	int socket;
+
+	for (;;) {
+		while (sem_wait(&poolQueued) != 0)
+			; // interrupted by signal
+		// The semaphore guarantees a socket is queued for us.
+		// We may have to wait for a concurrent producer to finish, though.
+		while (!poolDequeue(&socket))
+			sched_yield();
+		serveConnection(socket);
+	}
+
+	return null;
+}
+
+// Rejected connections
+
+// Closing a socket with unread data makes the kernel reset the connection,
+// and the client may drop the 503 reply then. The accept thread must not wait
+// for the request, though, so it hands the socket to the linger thread. The
+// linger thread reads and discards the request and closes the socket after
+// LINGER_TIMEOUT. The sockets are kept in a ring buffer in the order of their
+// deadlines. A socket is closed by the linger thread only when its deadline
+// has passed, so its descriptor cannot be reused while it is in the epoll set.
+
+#define LINGER_QUEUE_LENGTH 256
+
+typedef struct {
+	int socket;
+	int drained;
+	struct timespec deadline;
+} LingerCell;
+
+LingerCell lingerCell[LINGER_QUEUE_LENGTH];
+unsigned lingerIn = 0;  // next cell to be filled
+unsigned lingerOut = 0; // next cell to be closed
+pthread_mutex_t lingerMutex = PTHREAD_MUTEX_INITIALIZER;
+sem_t lingerQueued;
+int lingerFd = -1;
+
+// Milliseconds until the deadline, at least 0
+
+int lingerRemaining(const struct timespec* deadline) {
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+void lingerDrain(LingerCell* cell) {
+	char discard[1024];
+	ssize_t received;
+
+	while (cell->drained < HTTP_HEADER_LENGTH * 8) {
+		received = recv(cell->socket, discard, sizeof(discard), 0);
+		if (received > 0)
+			cell->drained += received;
+		else if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return; // wait for more
+		else
+			break;
+	}
+	// end of the request, or enough of it: no need to watch the socket any longer
+	epoll_ctl(lingerFd, EPOLL_CTL_DEL, cell->socket, null);
+}
+
+void* lingerThread(void* arg) {
+	struct epoll_event event[16];
+	int i, count, timeout;
+
+	for (;;) {
+		pthread_mutex_lock(&lingerMutex);
+		while (lingerOut != lingerIn && lingerRemaining(&lingerCell[lingerOut % LINGER_QUEUE_LENGTH].deadline) == 0)
+			close(lingerCell[lingerOut++ % LINGER_QUEUE_LENGTH].socket); // also removes it from the epoll set
+		timeout = lingerOut == lingerIn ? -1 : lingerRemaining(&lingerCell[lingerOut % LINGER_QUEUE_LENGTH].deadline);
+		pthread_mutex_unlock(&lingerMutex);
+
+		if (timeout < 0) {
+			while (sem_wait(&lingerQueued) != 0)
+				; // interrupted by signal
+			continue;
+		}
+		count = epoll_wait(lingerFd, event, sizeof(event) / sizeof(event[0]), timeout);
+		for (i = 0; i < count; i++)
+			lingerDrain(&lingerCell[event[i].data.u32]);
+	}
+	return null;
+}
+
+// Hand a rejected connection to the linger thread, which closes it
+
+void lingerAdd(const int socket) {
+	struct epoll_event event;
+	LingerCell* cell;
+	unsigned index;
+
+	pthread_mutex_lock(&lingerMutex);
+	if (lingerIn - lingerOut == LINGER_QUEUE_LENGTH) {
+		pthread_mutex_unlock(&lingerMutex);
+		close(socket); // too many, the client may see a reset
+		return;
+	}
+	index = lingerIn % LINGER_QUEUE_LENGTH;
+	cell = &lingerCell[index];
+	cell->socket = socket;
+	cell->drained = 0;
+	clock_gettime(CLOCK_MONOTONIC, &cell->deadline);
+	cell->deadline.tv_nsec += LINGER_TIMEOUT * 1000000L;
+	if (cell->deadline.tv_nsec >= 1000000000L) {
+		cell->deadline.tv_sec++;
+		cell->deadline.tv_nsec -= 1000000000L;
+	}
+	event.events = EPOLLIN | EPOLLRDHUP;
+	event.data.u32 = index;
+	epoll_ctl(lingerFd, EPOLL_CTL_ADD, socket, &event); // if this fails, the socket is just closed later
+	if (lingerIn++ == lingerOut)
+		sem_post(&lingerQueued); // the linger thread may be waiting for work
+	pthread_mutex_unlock(&lingerMutex);
+}
+
+boolean poolInit(void) {
+	pthread_t threadId;
+	unsigned i;
+
+	for (i = 0; i < POOL_QUEUE_LENGTH; i++)
+		poolCell[i].sequence = i;
+	if (sem_init(&poolQueued, 0, 0) || sem_init(&lingerQueued, 0, 0))
+		return false;
+	lingerFd = epoll_create1(EPOLL_CLOEXEC);
+	if (lingerFd < 0 || pthread_create(&threadId, null, lingerThread, null))
+		return false;
+	for (i = 0; i < WORKER_THREADS; i++)
+		if (pthread_create(&threadId, null, poolThread, null))
+			return false;
+	return true;
+}
+
+void poolDispatch(const int socket) {
+	if (poolEnqueue(socket)) {
+		sem_post(&poolQueued);
+		return;
+	}
+	// All workers are busy and the queue is full.
+	// Tell the client rather than silently dropping the connection.
+	#if DEBUG & 128
+	Log(socket, "Worker queue full for socket %d", socket);
+	#endif
+	httpServiceUnavailable(socket);
+	lingerAdd(socket);
+}
+
+#endif
@@ -20,38 +20,13 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "mrhttpd.h"
 
-enum HttpMethod {
-	HTTP_GET,
-	HTTP_HEAD,
-	HTTP_PUT,
-	HTTP_DELETE
-};
-
-enum HttpCodeIndex {
-	HTTP_200,
-	HTTP_201,
-	HTTP_202,
-	HTTP_204,
-	HTTP_300,
-	HTTP_301,
-	HTTP_302,
-	HTTP_304,
-	HTTP_400,
-	HTTP_401,
-	HTTP_403,
-	HTTP_404,
-	HTTP_500,
-	HTTP_501,
-	HTTP_502,
-	HTTP_503
-};
-
 #ifdef PRIVATE_DIR
 const char* httpFile[] = {
 	PRIVATE_DIR "/200.html",
 	PRIVATE_DIR "/201.html",
 	PRIVATE_DIR "/202.html",
 	PRIVATE_DIR "/204.html",
+	PRIVATE_DIR "/206.html",
 	PRIVATE_DIR "/300.html",
 	PRIVATE_DIR "/301.html",
 	PRIVATE_DIR "/302.html",
@@ -60,6 +35,8 @@ const char* httpFile[] = {
 	PRIVATE_DIR "/401.html",
 	PRIVATE_DIR "/403.html",
 	PRIVATE_DIR "/404.html",
+	PRIVATE_DIR "/413.html",
+	PRIVATE_DIR "/416.html",
 	PRIVATE_DIR "/500.html",
 	PRIVATE_DIR "/501.html",
 	PRIVATE_DIR "/502.html",
@@ -67,67 +44,477 @@ const char* httpFile[] = {
 };
 #endif
 
-const char* httpCodeString[] = {
-	"200 OK\r",
-	"201 Created\r",
-	"202 Accepted\r",
-	"204 No Content\r",
-	"300 Multiple Choices\r",
-	"301 Moved Permanently\r",
-	"302 Moved Temporarily\r",
-	"304 Not Modified\r",
-	"400 Bad Request\r",
-	"401 Unauthorized\r",
-	"403 Forbidden\r",
-	"404 Not Found\r",
-	"500 Internal Server Error\r",
-	"501 Not Implemented\r",
-	"502 Bad Gateway\r",
-	"503 Service Unavailable\r"
+// status line without the leading protocol token
+const Slice httpStatusLine[] = {
+	SLICE(" 200 OK\r\n"),
+	SLICE(" 201 Created\r\n"),
+	SLICE(" 202 Accepted\r\n"),
+	SLICE(" 204 No Content\r\n"),
+	SLICE(" 206 Partial Content\r\n"),
+	SLICE(" 300 Multiple Choices\r\n"),
+	SLICE(" 301 Moved Permanently\r\n"),
+	SLICE(" 302 Moved Temporarily\r\n"),
+	SLICE(" 304 Not Modified\r\n"),
+	SLICE(" 400 Bad Request\r\n"),
+	SLICE(" 401 Unauthorized\r\n"),
+	SLICE(" 403 Forbidden\r\n"),
+	SLICE(" 404 Not Found\r\n"),
+	SLICE(" 413 Payload Too Large\r\n"),
+	SLICE(" 416 Range Not Satisfiable\r\n"),
+	SLICE(" 500 Internal Server Error\r\n"),
+	SLICE(" 501 Not Implemented\r\n"),
+	SLICE(" 502 Bad Gateway\r\n"),
+	SLICE(" 503 Service Unavailable\r\n")
 };
 
-const char* connectionString[] = {
-	"Connection: keep-alive\r",
-	"Connection: close\r"
+const Slice connectionLine[] = {
+	SLICE("Connection: keep-alive\r\n"),
+	SLICE("Connection: close\r\n")
 };
 
-ConnectionState httpRequest(const int socket) {
+// Index of a status code in httpStatusLine, or of the first code of its class
+
+int httpCodeIndex(const int code) {
+	int i;
+
+	for (i = 0; i < HTTP_CODES; i++)
+		if (atoi(httpStatusLine[i].text + 1) == code)
+			return i;
+	return code < 300 ? HTTP_200 : code < 400 ? HTTP_300 : code < 500 ? HTTP_400 : HTTP_500;
+}
+
+#if FILE_CACHE_SMALL_FILE > 0
+// status line and connection header of a reply served from memory, by protocol and connection state
+const Slice replyPrefix200[2][2] = {
+	{ SLICE(PROTOCOL_HTTP_1_0 " 200 OK\r\nAccept-Ranges: bytes\r\nConnection: keep-alive\r\n"), SLICE(PROTOCOL_HTTP_1_0 " 200 OK\r\nAccept-Ranges: bytes\r\nConnection: close\r\n") },
+	{ SLICE(PROTOCOL_HTTP_1_1 " 200 OK\r\nAccept-Ranges: bytes\r\nConnection: keep-alive\r\n"), SLICE(PROTOCOL_HTTP_1_1 " 200 OK\r\nAccept-Ranges: bytes\r\nConnection: close\r\n") }
+};
+#endif
+
+// Append the entity header lines of a reply to the memory pool, ready to be sent.
+
+boolean addEntityHeader(MemPool* mp, const off_t contentLength, const char* contentType) {
+	return
+		memPoolAppendLiteral(mp, "Server: " SERVER_SOFTWARE "\r\nContent-Length: ") ||
+		memPoolAppendNumber(mp, contentLength) ||
+		memPoolAppendLiteral(mp, "\r\nContent-Type: ") ||
+		memPoolAppend(mp, contentType, strlen(contentType)) ||
+		memPoolAppendLiteral(mp, "\r\n")
+		#ifdef PRAGMA
+		|| memPoolAppendLiteral(mp, "Pragma: " PRAGMA "\r\n")
+		#endif
+		;
+}
+
+#ifdef PRIVATE_DIR
+
+// Error pages
+
+// The status pages in PRIVATE_DIR are read at start-up and again after SIGHUP.
+// Each one is kept as a complete reply, minus the leading protocol token, for
+// both connection states. Sending an error reply is a single system call then.
+// A reload builds a new set of replies and swaps it in. The previous set is
+// freed as soon as the last request using it lets go of it.
+
+typedef struct {
+	int refCount;
+	char* reply[HTTP_CODES][2];      // by status code and connection state
+	int length[HTTP_CODES][2];       // complete reply
+	int headerLength[HTTP_CODES][2]; // reply header only, for HEAD requests
+} ErrorPages;
+
+ErrorPages* errorPages = null;
+pthread_mutex_t errorPagesMutex = PTHREAD_MUTEX_INITIALIZER;
+volatile sig_atomic_t errorPagesStale = 0;
+
+void errorPagesFree(ErrorPages* pages) {
+	int code, state;
+
+	for (code = 0; code < HTTP_CODES; code++)
+		for (state = 0; state < 2; state++)
+			free(pages->reply[code][state]);
+	free(pages);
+}
+
+ErrorPages* errorPagesLoad(void) {
+	char headerBuf[512];
+	MemPool headerPool = { sizeof(headerBuf), 0, headerBuf };
+	ErrorPages* pages;
+	struct stat st;
+	char* body;
+	unsigned size;
+	int code, state, fd;
+
+	pages = (ErrorPages*) calloc(1, sizeof(ErrorPages));
+	if (pages == null)
+		return null;
+	for (code = 0; code < HTTP_CODES; code++) {
+		body = null;
+		size = 0;
+		if ((fd = open(httpFile[code], O_RDONLY)) >= 0) {
+			if (fstat(fd, &st) == 0 && (body = (char*) malloc(st.st_size + 1)) != null) {
+				size = (unsigned) st.st_size;
+				if (read(fd, body, size) != size) {
+					#if LOG_LEVEL > 0
+					Log(0, "Server Doc Read Error  \"READ %s\"", httpFile[code]);
+					#endif
+					free(body);
+					body = null;
+					size = 0;
+				}
+			}
+			close(fd);
+		}
+		for (state = 0; state < 2; state++) {
+			memPoolReset(&headerPool);
+			if (
+				memPoolAppendSlice(&headerPool, httpStatusLine[code]) ||
+				(body != null ? addEntityHeader(&headerPool, size, "text/html") : (
+					memPoolAppendLiteral(&headerPool, "Server: " SERVER_SOFTWARE "\r\nContent-Length: 0\r\n")
+					#ifdef PRAGMA
+					|| memPoolAppendLiteral(&headerPool, "Pragma: " PRAGMA "\r\n")
+					#endif
+				)) ||
+				(code == HTTP_401 && memPoolAppendLiteral(&headerPool, "WWW-Authenticate: Basic realm=\"Realm\"\r\n")) ||
+				memPoolAppendSlice(&headerPool, connectionLine[state]) ||
+				memPoolAppendLiteral(&headerPool, "\r\n") ||
+				(pages->reply[code][state] = (char*) malloc(headerPool.current + size)) == null
+			) {
+				free(body);
+				errorPagesFree(pages);
+				return null;
+			}
+			memcpy(pages->reply[code][state], headerBuf, headerPool.current);
+			if (size > 0)
+				memcpy(pages->reply[code][state] + headerPool.current, body, size);
+			pages->headerLength[code][state] = headerPool.current;
+			pages->length[code][state] = headerPool.current + size;
+		}
+		free(body);
+	}
+	return pages;
+}
+
+boolean errorPagesInit(void) {
+	return (errorPages = errorPagesLoad()) != null;
+}
+
+// Called from the SIGHUP handler, hence nothing but a flag
+
+void errorPagesReload(void) {
+	errorPagesStale = 1;
+}
+
+ErrorPages* errorPagesAcquire(void) {
+	ErrorPages* pages;
+	ErrorPages* previous = null;
+
+	if (errorPagesStale) {
+		errorPagesStale = 0;
+		#if LOG_LEVEL > 0
+		Log(0, "Reloading error pages");
+		#endif
+		if ((pages = errorPagesLoad()) != null) {
+			pthread_mutex_lock(&errorPagesMutex);
+			if (errorPages != null && errorPages->refCount == 0)
+				previous = errorPages;
+			errorPages = pages;
+			pthread_mutex_unlock(&errorPagesMutex);
+			if (previous != null)
+				errorPagesFree(previous);
+		}
+	}
+	pthread_mutex_lock(&errorPagesMutex);
+	pages = errorPages;
+	if (pages != null)
+		pages->refCount++;
+	pthread_mutex_unlock(&errorPagesMutex);
+	return pages;
+}
+
+void errorPagesRelease(ErrorPages* pages) {
+	boolean retired;
+
+	pthread_mutex_lock(&errorPagesMutex);
+	retired = --pages->refCount == 0 && pages != errorPages;
+	pthread_mutex_unlock(&errorPagesMutex);
+	if (retired)
+		errorPagesFree(pages);
+}
+
+// Send the error reply for the given status code, returns -1 on failure
+
+ssize_t errorPageSend(const int socket, const char* protocol, const int statusCode, const ConnectionState connectionState, const boolean headerOnly, const int flags) {
+	ErrorPages* pages = errorPagesAcquire();
+	struct iovec iov[2];
+	ssize_t rc;
+
+	if (pages == null)
+		return -1;
+	iov[0].iov_base = (void*) protocol;
+	iov[0].iov_len = strlen(protocol);
+	iov[1].iov_base = pages->reply[statusCode][connectionState];
+	iov[1].iov_len = (headerOnly ? pages->headerLength : pages->length)[statusCode][connectionState];
+	rc = sendVector(socket, iov, 2, flags);
+	errorPagesRelease(pages);
+	return rc;
+}
+
+#endif
+
+// A cheap entity tag derived from the file status: "inode-mtime-size" in hex.
+
+boolean addETag(MemPool* mp, const struct stat* st) {
+	return
+		memPoolAppendLiteral(mp, "\"") ||
+		memPoolAppendHex(mp, st->st_ino) ||
+		memPoolAppendLiteral(mp, "-") ||
+		memPoolAppendHex(mp, st->st_mtime) ||
+		memPoolAppendLiteral(mp, "-") ||
+		memPoolAppendHex(mp, st->st_size) ||
+		memPoolAppendLiteral(mp, "\"");
+}
+
+boolean addValidatorHeader(MemPool* mp, const struct stat* st) {
+	return
+		memPoolAppendLiteral(mp, "ETag: ") ||
+		addETag(mp, st) ||
+		memPoolAppendLiteral(mp, "\r\nLast-Modified: ") ||
+		memPoolAppendDate(mp, st->st_mtime) ||
+		memPoolAppendLiteral(mp, "\r\n");
+}
+
+// Weak comparison of an entity tag with the list of an If-None-Match header
+
+boolean etagListMatches(const char* list, const char* etag, const int length) {
+	for (;;) {
+		while (*list == ' ' || *list == ',')
+			list++;
+		if (*list == '\0')
+			return false;
+		if (*list == '*')
+			return true;
+		if (list[0] == 'W' && list[1] == '/')
+			list += 2;
+		if (!strncmp(list, etag, length))
+			return true;
+		list = strchr(list, ',');
+		if (list == null)
+			return false;
+	}
+}
+
+// If-Range carries either an entity tag, which has to match strongly,
+// or the exact modification date of the file.
+
+boolean ifRangeMatches(const char* value, const char* etag, const int length, const time_t modified) {
+	time_t t;
+
+	if (*value == '"')
+		return !strncmp(value, etag, length) && *startOf((char*) value + length) == '\0';
+	return !httpDateParse(value, &t) && t == modified;
+}
+
+// Content codings of precompressed sidecar files, in order of preference
+
+typedef enum { ENCODING_BR, ENCODING_ZSTD, ENCODING_GZIP, ENCODINGS } EncodingIndex;
+
+typedef struct {
+	Slice name;   // as in Accept-Encoding and Content-Encoding
+	Slice suffix; // of the sidecar file
+} Encoding;
+
+const Encoding encoding[ENCODINGS] = {
+	[ENCODING_BR]   = { SLICE("br"),   SLICE(".br") },
+	[ENCODING_ZSTD] = { SLICE("zstd"), SLICE(".zst") },
+	[ENCODING_GZIP] = { SLICE("gzip"), SLICE(".gz") }
+};
+
+#define ENCODINGS_ALL ((1 << ENCODINGS) - 1)
+
+// Evaluate an Accept-Encoding header, returns the bitmask of acceptable encodings.
+// A coding with a quality value of 0 is not acceptable.
+
+int acceptEncodingParse(const char* value) {
+	const char* next;
+	const char* param;
+	int encodings = 0;
+	int i, length;
+
+	for (; *value != '\0'; value = next) {
+		while (*value == ' ' || *value == ',')
+			value++;
+		next = strchr(value, ',');
+		if (next == null)
+			next = value + strlen(value);
+		length = strcspn(value, " ;,");
+		param = memchr(value, ';', next - value);
+		if (param != null) {
+			while (*++param == ' ')
+				;
+			if ((*param == 'q' || *param == 'Q') && param[1] == '=' && strtod(param + 2, null) == 0)
+				continue; // not acceptable
+		}
+		if (length == 1 && *value == '*')
+			encodings |= ENCODINGS_ALL;
+		for (i = 0; i < ENCODINGS; i++)
+			if (encoding[i].name.length == length && !strncasecmp(value, encoding[i].name.text, length))
+				encodings |= 1 << i;
+	}
+	return encodings;
+}
+
+// Find the precompressed sidecar files of a file among the given encodings
+
+int sidecarProbe(MemPool* fileNamePool, const int encodings) {
+	const int savePosition = fileNamePool->current;
+	struct stat st;
+	int variants = 0;
+	int i;
+
+	for (i = 0; i < ENCODINGS; i++)
+		if (encodings & (1 << i)) {
+			if (!memPoolExtend(fileNamePool, encoding[i].suffix.text) && !stat(fileNamePool->mem, &st) && S_ISREG(st.st_mode))
+				variants |= 1 << i;
+			memPoolResetTo(fileNamePool, savePosition);
+		}
+	return variants;
+}
+
+#if FILE_CACHE_ENTRIES > 0
+// The cache key of an encoded variant is the key of the original file plus a NUL byte and the
+// encoding index. No path contains a NUL byte, so the key cannot collide with a requested file,
+// such as the sidecar file itself. Returns the length of the key, or -1 if it does not fit.
+
+int sidecarKey(char* key, const int size, const char* name, const int length, const int index) {
+	if (length + 2 >= size)
+		return -1;
+	memcpy(key, name, length);
+	key[length] = '\0';
+	key[length + 1] = '0' + index;
+	return length + 2;
+}
+#endif
+
+// Content-Encoding and Vary header lines, as far as applicable
+
+boolean addEncodingHeader(MemPool* mp, const char* contentType, const int encodingIndex) {
+	return
+		(encodingIndex >= 0 && (
+			memPoolAppendLiteral(mp, "Content-Encoding: ") ||
+			memPoolAppendSlice(mp, encoding[encodingIndex].name) ||
+			memPoolAppendLiteral(mp, "\r\n")
+		)) ||
+		(mimeCompressible(contentType) && memPoolAppendLiteral(mp, "Vary: Accept-Encoding\r\n"));
+}
+
+// All entity header lines of a reply carrying a file, or part of a file
+
+boolean addFileHeader(MemPool* mp, const off_t contentLength, const struct stat* st, const char* contentType, const int encodingIndex) {
+	return
+		addEntityHeader(mp, contentLength, contentType) ||
+		addValidatorHeader(mp, st) ||
+		addEncodingHeader(mp, contentType, encodingIndex);
+}
+
+// Evaluate the value of a Range header for a file of the given size.
+// Returns HTTP_206 with the first byte and the length of the range,
+// HTTP_416 if the range lies beyond the end of the file, or HTTP_200 if
+// the header is to be ignored and the complete file is to be sent. This
+// includes multiple ranges, which are not supported.
+
+int rangeParse(const char* spec, const off_t size, off_t* first, off_t* length) {
+	char* end;
+	off_t from, last;
+
+	if (strncasecmp(spec, "bytes=", 6))
+		return HTTP_200; // unknown unit
+	spec += 6;
+	if (*spec == '-') { // suffix range: the final bytes of the file
+		if (!isdigit(spec[1]))
+			return HTTP_200;
+		last = strtoll(spec + 1, &end, 10);
+		if (last == 0 || size == 0)
+			return HTTP_416;
+		from = last >= size ? 0 : size - last;
+		last = size - 1;
+	} else {
+		if (!isdigit(*spec))
+			return HTTP_200;
+		from = strtoll(spec, &end, 10);
+		if (*end++ != '-')
+			return HTTP_200;
+		if (isdigit(*end)) {
+			last = strtoll(end, &end, 10);
+			if (last < from)
+				return HTTP_200; // invalid range
+			if (last >= size)
+				last = size - 1;
+		} else
+			last = size - 1; // open-ended range
+		if (from >= size)
+			return HTTP_416;
+	}
+	if (*startOf(end) != '\0')
+		return HTTP_200; // multiple ranges or trailing garbage
+	*first = from;
+	*length = last - from + 1;
+	return HTTP_206;
+}
+
+ConnectionState httpRequest(const int socket, MemPool* stream) {
 
 	ConnectionState connectionState = CONNECTION_CLOSE;
 
 	char* method; 
-	char* resource;
+	char* resource = null;
 	char* protocol = PROTOCOL_HTTP_1_1;
 	char* query; 
 	char* connection;
 	
 	int statusCode = HTTP_400;
+	int httpMethod = HTTP_GET;
+	int sendFlags = 0;
+	ssize_t sent = 0; // bytes of the reply
+	#ifdef METRICS_PATH
+	off_t fileSent = 0; // thereof sent via sendFile()
+	#endif
+	int acceptedEncodings = 0;
+	int encodingIndex = -1; // content coding of the file sent, if any
+	int variants = 0;
 
 	struct stat st;
 	FILE* file = null;
 	int fd = -1;
 
-	unsigned int contentLength;
+	off_t contentLength;
+	off_t rangeOffset = 0;
 	const char* contentType;
 
+	#if FILE_CACHE_ENTRIES > 0
+	FileEntry* entry = null;
+	#endif
+
 	char fileNameBuf[512];
 	MemPool fileNamePool = { sizeof(fileNameBuf), 0, fileNameBuf };
 	char* fileName = fileNameBuf;
 
-	char streamBuf[HTTP_HEADER_LENGTH];
-	MemPool streamMemPool = { sizeof(streamBuf), 0, streamBuf };
-
 	char requestHeaderBuf[HTTP_HEADER_LENGTH];
 	MemPool requestHeaderMemPool = { sizeof(requestHeaderBuf), 0, requestHeaderBuf };
 	char* requestHeader[64];
 	StringPool requestHeaderPool = { sizeof(requestHeader), 0, requestHeader, &requestHeaderMemPool };
+	HeaderIndex requestHeaderIndex;
 
 	char replyHeaderBuf[512];
 	MemPool replyHeaderMemPool = { sizeof(replyHeaderBuf), 0, replyHeaderBuf };
-	char* replyHeader[16];
-	StringPool replyHeaderPool = { sizeof(replyHeader), 0, replyHeader, &replyHeaderMemPool };
 
-	#if LOG_LEVEL > 0 || defined(CGI_PATH)
+	char extraHeaderBuf[160];
+	MemPool extraHeaderMemPool = { sizeof(extraHeaderBuf), 0, extraHeaderBuf }; // header lines specific to the reply, e.g. Content-Range
+
+	char etagBuf[64];
+	MemPool etagMemPool = { sizeof(etagBuf), 0, etagBuf };
+
+	#if LOG_LEVEL > 0 || defined(CGI_PATH) || defined(ACCESS_LOG_FILE)
 	struct sockaddr_in sa;
 	int addressLength = sizeof(struct sockaddr_in);
 	getpeername(socket, (struct sockaddr*)&sa, (socklen_t*) &addressLength);
@@ -137,7 +524,7 @@ ConnectionState httpRequest(const int socket) {
 	#endif
 
 	// Read request header
-	int rc = parseHeader(socket, &streamMemPool, &requestHeaderPool);
+	int rc = parseHeader(socket, stream, &requestHeaderPool, &requestHeaderIndex);
 	if (rc <= 0) {
 		#if LOG_LEVEL > 0
 		if (rc == 0)
@@ -145,6 +532,10 @@ ConnectionState httpRequest(const int socket) {
 		#endif
 		return CONNECTION_CLOSE; // socket is in undefined state
 	}
+	#ifdef ACCESS_LOG_FILE
+	struct timespec requestStart;
+	clock_gettime(CLOCK_MONOTONIC, &requestStart);
+	#endif
 
 	#if DEBUG & 32
 	for (char** rh = requestHeader, i = requestHeaderPool.current; i > 0; rh++, i--)
@@ -154,11 +545,14 @@ ConnectionState httpRequest(const int socket) {
 	// Parse first header line
 	char* headerLine = requestHeader[0];
 	method = strsep(&headerLine, " ");
-	int httpMethod;
 	if (!strcmp(method, "GET"))
 		httpMethod = HTTP_GET;
 	else if (!strcmp(method, "HEAD"))
 		httpMethod = HTTP_HEAD;
+	#ifdef CGI_PATH
+	else if (!strcmp(method, "POST"))
+		httpMethod = HTTP_POST;
+	#endif
 	#ifdef PUT_PATH
 	else if (!strcmp(method, "PUT"))
 		httpMethod = HTTP_PUT;
@@ -172,6 +566,8 @@ ConnectionState httpRequest(const int socket) {
 		statusCode = HTTP_501;
 		goto _sendError; // unknown method
 	}
+	if (httpMethod != HTTP_PUT && httpMethod != HTTP_POST && memmem(stream->mem, stream->current, "\r\n\r\n", 4) != null)
+		sendFlags = MSG_MORE; // another request is pipelined already: let its reply join this one
 	if (headerLine == null) {
 		#if LOG_LEVEL > 0
 		Log(socket, "%15s  400  Missing resource", client);
@@ -207,7 +603,7 @@ ConnectionState httpRequest(const int socket) {
 	Log(socket, "%15s  OK   \"%s %s %s\"", client, method, resource, protocol);
 	#endif
 
-	connection = strToLower(stringPoolReadHttpHeader(&requestHeaderPool, "connection")); // header name in lower case
+	connection = strToLower(requestHeaderIndex.value[HEADER_CONNECTION]);
 	if (strcmp(protocol, PROTOCOL_HTTP_1_1) == 0) {
 		connectionState = CONNECTION_KEEPALIVE;
 		if (connection != null && strcmp(connection, "close") == 0)
@@ -249,7 +645,7 @@ ConnectionState httpRequest(const int socket) {
 
 	int sendWwwAuthenticate = 0;
 	if (authHeader && (authMethods & (1 << httpMethod))) {
-		char* requestAuthHeader = stringPoolReadHttpHeader(&requestHeaderPool, "authorization"); // header name in lower case
+		char* requestAuthHeader = requestHeaderIndex.value[HEADER_AUTHORIZATION];
 		if (requestAuthHeader == null) {
 			#if LOG_LEVEL > 0
 			Log(socket, "%15s  401  \"AUTH header missing\"", client);
@@ -279,9 +675,26 @@ ConnectionState httpRequest(const int socket) {
 		goto _sendError; // potential security risk - zero tolerance
 	}
 
+	#ifdef METRICS_PATH
+	if (!strcmp(resource, METRICS_PATH) && (httpMethod == HTTP_GET || httpMethod == HTTP_HEAD)) {
+		file = tmpfile();
+		if (file == null || metricsWrite(file) || fflush(file) || (fd = fileno(file)) < 0 || fstat(fd, &st)) {
+			#if LOG_LEVEL > 2
+			Log(socket, "%15s  500  \"METRICS failed write\"", client);
+			#endif
+			goto _sendError500;
+		}
+		rewind(file);
+		contentType = "text/plain; version=0.0.4";
+		goto _sendFile200;
+	}
+	#endif
+
 	#ifdef CGI_PATH
 	char* env[96];
-	StringPool envPool = { sizeof(env), 0, env, &streamMemPool };
+	char envBuf[HTTP_HEADER_LENGTH + 1024];
+	MemPool envMemPool = { sizeof(envBuf), 0, envBuf }; // not the stream, which may hold a pipelined request
+	StringPool envPool = { sizeof(env) / sizeof(env[0]) - 1, 0, env, &envMemPool }; // room for the terminating null
 
 	if (!strncmp(resource, CGI_PATH, strlen(CGI_PATH))) { // presence of CGI path prefix indicates CGI script
 		if (memPoolAdd(&fileNamePool, CGI_DIR) || memPoolExtend(&fileNamePool, resource + strlen(CGI_PATH)))
@@ -300,6 +713,7 @@ ConnectionState httpRequest(const int socket) {
 			statusCode = HTTP_403;
 			goto _sendError;
 		}
+		#ifndef FASTCGI_SOCKET
 		if (access(fileName, X_OK)) {
 			#if LOG_LEVEL > 2
 			Log(socket, "%15s  503  \"CGI %s %s\"", client, fileName, query == null ? "" : query);
@@ -307,13 +721,28 @@ ConnectionState httpRequest(const int socket) {
 			statusCode = HTTP_503;
 			goto _sendError;
 		}
+		#endif
+		contentLength = 0;
+		if (httpMethod == HTTP_POST && requestHeaderIndex.value[HEADER_CONTENT_LENGTH] != null) {
+			contentLength = atoll(requestHeaderIndex.value[HEADER_CONTENT_LENGTH]);
+			if (contentLength < 0) {
+				statusCode = HTTP_400;
+				goto _sendError;
+			}
+			if (contentLength > CGI_MAX_BODY) {
+				#if LOG_LEVEL > 2
+				Log(socket, "%15s  413  \"CGI %s %lld\"", client, fileName, (long long) contentLength);
+				#endif
+				statusCode = HTTP_413;
+				goto _sendError;
+			}
+		}
 		#if LOG_LEVEL > 3
 		Log(socket, "%15s  000  \"CGI %s %s\"", client, fileName, query == null ? "" : query);
 		#endif
 
 		// set up environment of cgi program
 		stringPoolReset(&envPool);
-		stringPoolReset(&replyHeaderPool);
 		if (
 			stringPoolAddVariable(&envPool, "SERVER_NAME",  SERVER_NAME) ||
 			stringPoolAddVariable(&envPool, "SERVER_PORT",  SERVER_PORT_STR) ||
@@ -324,64 +753,52 @@ ConnectionState httpRequest(const int socket) {
 			stringPoolAddVariable(&envPool, "QUERY_STRING", (query == null) ? "" : query) ||
 			stringPoolAddVariable(&envPool, "REMOTE_ADDR", client) ||
 			stringPoolAddVariableNumber(&envPool, "REMOTE_PORT", port) ||
-			stringPoolAddVariables(&envPool, &requestHeaderPool, "HTTP_") ||
-			//set up reply header
-			stringPoolAdd(&replyHeaderPool, protocol) ||
-			memPoolExtendChar(&replyHeaderMemPool, ' ') ||
-			memPoolExtend(&replyHeaderMemPool, httpCodeString[HTTP_200]) ||
-			stringPoolAdd(&replyHeaderPool, "Server: " SERVER_SOFTWARE "\r") ||
-			stringPoolAdd(&replyHeaderPool, connectionString[CONNECTION_CLOSE])
+			(httpMethod == HTTP_POST && stringPoolAddVariableNumber(&envPool, "CONTENT_LENGTH", contentLength)) ||
+			(httpMethod == HTTP_POST && requestHeaderIndex.value[HEADER_CONTENT_TYPE] != null &&
+				stringPoolAddVariable(&envPool, "CONTENT_TYPE", requestHeaderIndex.value[HEADER_CONTENT_TYPE])) ||
+			stringPoolAddVariables(&envPool, &requestHeaderPool, "HTTP_")
 		) {
 			#if LOG_LEVEL > 0
-			Log(socket, "Memory Error preparing CGI header for %s", fileName);
+			Log(socket, "Memory Error preparing CGI environment for %s", fileName);
 			#endif
 			goto _sendError500;
 		}
-		memPoolReplace(&replyHeaderMemPool, '\0', '\n');
-				
-		pid_t childPid = fork();
-		if (childPid == 0) {
-			// child process continues here
-			// Note: the child path should only be debugged in emergency cases because
-			// the logFile mutex will not be released if set at the time of forking
-			// and thus a fraction of the forked processes will hang
-			#if DEBUG & 512
-			Log(socket, "CGI Fork Child: Preparing to launch %s", fileName);
-			#endif
-			if (sendMemPool(socket, &replyHeaderMemPool) >= 0 ) {
-				#if DEBUG & 512
-				Log(socket, "CGI Fork Child: Reply header sent for %s", fileName);
-				#endif
-				if (dup2(socket, 1) == 1) { // Known Bug: the overspill from parseHeader() is missing from the stream
-					#if DEBUG & 512
-					Log(socket, "CGI Fork Child: Executing %s", fileName);
-					#endif
-					chdir(CGI_DIR);
-					execve(fileName, null, env); // should never return
-				}
-				#if DEBUG & 512
-				Log(socket, "CGI Fork Child: Failed to launch %s", fileName);
+
+		CgiBody body = { socket, stream, contentLength };
+		CgiReply reply;
+		// The body of a PUT request is not passed on, and the end of a POST request
+		// without Content-Length is unknown, so the connection cannot be reused.
+		cgiReplyInit(&reply, socket, protocol, httpMethod == HTTP_HEAD,
+			httpMethod == HTTP_PUT || (httpMethod == HTTP_POST && requestHeaderIndex.value[HEADER_CONTENT_LENGTH] == null) ? CONNECTION_CLOSE : connectionState, sendFlags);
+		#ifdef FASTCGI_SOCKET
+		rc = fastcgiRequest(&envPool, &body, &reply);
+		#elif CGI_WORKERS > 0
+		rc = scgiRequest(fileName, st.st_mtime, &envPool, &body, &reply);
+		#else
+		rc = cgiRequest(fileName, &envPool, &body, &reply);
+		#endif
+		if (rc) {
+			if (reply.sent == 0) {
+				#if LOG_LEVEL > 0
+				Log(socket, "%15s  502  \"CGI %s failed\"", client, fileName);
 				#endif
-				exit(-1); // exit child process
+				statusCode = HTTP_502;
+				goto _sendError;
 			}
-			#if DEBUG & 512
-			Log(socket, "CGI Fork Child: Failed to send header for %s", fileName);
-			#endif
-			exit(-1); // exit child process
+			reply.connectionState = CONNECTION_CLOSE; // the reply is incomplete
 		}
-		// parent process continues here
-		if (childPid == -1)
-			goto _sendError500; // fork error
-		// unfortunately it turns out to be better to wait for the child to exit
-		// since otherwise the connection hangs on rare occasions
-		#if DEBUG & 256
-		Log(socket, "CGI Fork Parent: waiting for child %d", childPid);
-		#endif
-		waitpid(childPid, null, 0);
-		#if DEBUG & 256
-		Log(socket, "CGI Fork Parent: wait finished for child %d", childPid);
+		statusCode = reply.statusCode;
+		sent = reply.sent;
+		connectionState = reply.connectionState;
+		goto _return;
+	}
+
+	if (httpMethod == HTTP_POST) {
+		#if LOG_LEVEL > 2
+		Log(socket, "%15s  501  \"POST %s\"", client, resource);
 		#endif
-		return CONNECTION_CLOSE;
+		statusCode = HTTP_501;
+		goto _sendError; // POST is for CGI scripts only
 	}
 	#endif
 
@@ -406,11 +823,14 @@ ConnectionState httpRequest(const int socket) {
 				#endif
 				goto _sendError500;
 			}
+			#if FILE_CACHE_ENTRIES > 0
+			fileCacheFlush();
+			#endif
 			statusCode = HTTP_200;
 			goto _sendEmptyResponse;
 		} else { // httpMethod == HTTP_PUT
-			char* headerContentLength = stringPoolReadHttpHeader(&requestHeaderPool, "content-length"); // header name in lower case
-			contentLength = headerContentLength == null ? 0 : atoi(headerContentLength);
+			char* headerContentLength = requestHeaderIndex.value[HEADER_CONTENT_LENGTH];
+			contentLength = headerContentLength == null ? 0 : atoll(headerContentLength);
 			// Simple Body Upload
 			int uploadFile = openFileForWriting(&fileNamePool, resource);
 			if (uploadFile < 0) {
@@ -420,23 +840,24 @@ ConnectionState httpRequest(const int socket) {
 				goto _sendError500;
 			}
 			#if DEBUG & 1024
-			Log(socket, "contentLength=\"%u\", overspill=\"%d\"", contentLength, streamMemPool.current);
+			Log(socket, "contentLength=\"%lld\", overspill=\"%d\"", (long long) contentLength, stream->current);
 			#endif
-			if (contentLength > 0 && streamMemPool.current > 0) { // overspill from parseHeader()
+			if (contentLength > 0 && stream->current > 0) { // overspill from parseHeader()
 				unsigned size = contentLength;
-				if (streamMemPool.current < size)
-					size = streamMemPool.current;
-				if (write(uploadFile, streamMemPool.mem, size) != size) {
+				if (stream->current < size)
+					size = stream->current;
+				if (write(uploadFile, stream->mem, size) != size) {
 					#if LOG_LEVEL > 2
 					Log(socket, "%15s  500  \"PUT overspill error\"", client);
 					#endif
 					close(uploadFile);
 					goto _sendError500;
 				}
+				memPoolConsume(stream, size); // keep a pipelined request following the body
 				contentLength -= size;
 			}
 			#if DEBUG & 1024
-			Log(socket, "remaining=\"%u\"", contentLength);
+			Log(socket, "remaining=\"%lld\"", (long long) contentLength);
 			#endif
 			if (contentLength > 0 && pipeToFile(socket, uploadFile, contentLength) < 0) {
 				#if LOG_LEVEL > 2
@@ -451,6 +872,9 @@ ConnectionState httpRequest(const int socket) {
 				#endif
 				goto _sendError500;
 			}
+			#if FILE_CACHE_ENTRIES > 0
+			fileCacheFlush();
+			#endif
 			statusCode = HTTP_200;
 			goto _sendEmptyResponse;
 		}
@@ -461,6 +885,37 @@ ConnectionState httpRequest(const int socket) {
 	if (memPoolExtend(&fileNamePool, resource)) 
 		goto _sendError500;
 
+	if (requestHeaderIndex.value[HEADER_ACCEPT_ENCODING] != null)
+		acceptedEncodings = acceptEncodingParse(requestHeaderIndex.value[HEADER_ACCEPT_ENCODING]);
+
+	#if FILE_CACHE_ENTRIES > 0
+	int cacheKeyLength = memPoolNextTarget(&fileNamePool);
+	char sidecarKeyBuf[256];
+	int sidecarKeyLength;
+	int cacheEncoding = -1; // content coding the cached entry must have
+	entry = fileCacheGet(fileName, cacheKeyLength);
+	if (entry != null && (entry->variants & acceptedEncodings)) {
+		// the client accepts a precompressed sidecar file, which may be cached, too
+		cacheEncoding = __builtin_ctz(entry->variants & acceptedEncodings);
+		sidecarKeyLength = sidecarKey(sidecarKeyBuf, sizeof(sidecarKeyBuf), fileName, cacheKeyLength, cacheEncoding);
+		fileCacheRelease(entry);
+		entry = sidecarKeyLength < 0 ? null : fileCacheGet(sidecarKeyBuf, sidecarKeyLength);
+	}
+	if (entry != null && entry->encoding != cacheEncoding) {
+		fileCacheRelease(entry); // not what the request negotiated
+		entry = null;
+	}
+	if (entry != null) {
+		fd = entry->fd;
+		st.st_size = entry->size;
+		st.st_mtime = entry->modified;
+		st.st_ino = entry->inode;
+		contentType = entry->contentType;
+		encodingIndex = entry->encoding;
+		goto _sendFile200;
+	}
+	#endif
+
 	statusCode = HTTP_404;
 
 	if (stat(fileName, &st)) {
@@ -515,6 +970,22 @@ ConnectionState httpRequest(const int socket) {
 		#else
 		contentType = "application/xml";
 		#endif
+		#if COMPRESS_CACHE_ENTRIES > 0
+		if ((acceptedEncodings & (1 << ENCODING_GZIP)) && st.st_size >= COMPRESS_MIN_SIZE && st.st_size <= COMPRESS_MAX_SIZE) {
+			// generated anew for every request, so it is compressed anew, too
+			struct stat compressedSt;
+			int compressedFd = compressTemporary(fd, &st, &compressedSt);
+			FILE* compressed = compressedFd < 0 ? null : fdopen(compressedFd, "r");
+			if (compressed != null) {
+				fclose(file);
+				file = compressed;
+				fd = compressedFd;
+				st = compressedSt;
+				encodingIndex = ENCODING_GZIP;
+			} else if (compressedFd >= 0)
+				close(compressedFd);
+		}
+		#endif
 		goto _sendFile200;
 		#else
 		#if LOG_LEVEL > 2
@@ -542,7 +1013,67 @@ _foundFile:
 		goto _sendError;
 	}
 
-	contentType = mimeType(fileName);
+	contentType = mimeTypeOfFile(fileName, fd, &st);
+	if (mimeCompressible(contentType)) {
+		#if FILE_CACHE_ENTRIES > 0
+		variants = sidecarProbe(&fileNamePool, ENCODINGS_ALL); // recorded in the cache entry
+		#else
+		variants = sidecarProbe(&fileNamePool, acceptedEncodings);
+		#endif
+		#if COMPRESS_CACHE_ENTRIES > 0
+		if (st.st_size >= COMPRESS_MIN_SIZE && st.st_size <= COMPRESS_MAX_SIZE)
+			variants |= 1 << ENCODING_GZIP; // if there is no sidecar, compress on the fly
+		#endif
+	}
+
+	#if FILE_CACHE_ENTRIES > 0
+	// on success the cache takes ownership of the file descriptor
+	entry = fileCachePut(fileName, cacheKeyLength, fd, &st, contentType, variants, -1);
+	if (entry != null)
+		fd = entry->fd; // small files are kept in memory, the file is closed already
+	#endif
+
+	if (variants & acceptedEncodings) {
+		// Serve the precompressed sidecar file instead, or else a variant compressed on the fly.
+		// Either keeps the content type of the original file.
+		int sidecarIndex = __builtin_ctz(variants & acceptedEncodings);
+		int savePosition = fileNamePool.current;
+		struct stat sidecarSt;
+		int sidecarFd = -1;
+		if (!memPoolExtend(&fileNamePool, encoding[sidecarIndex].suffix.text))
+			sidecarFd = open(fileName, O_RDONLY);
+		if (sidecarFd >= 0 && fstat(sidecarFd, &sidecarSt)) {
+			close(sidecarFd);
+			sidecarFd = -1;
+		}
+		if (sidecarFd < 0)
+			memPoolResetTo(&fileNamePool, savePosition); // carry on with the original file
+		#if COMPRESS_CACHE_ENTRIES > 0
+		if (sidecarFd < 0 && sidecarIndex == ENCODING_GZIP)
+			sidecarFd = compressCacheGet(fileName, &st, &sidecarSt);
+		#endif
+		if (sidecarFd >= 0) {
+			#if FILE_CACHE_ENTRIES > 0
+			if (entry != null) {
+				fileCacheRelease(entry);
+				entry = null;
+			} else
+			#endif
+			close(fd);
+			fd = sidecarFd;
+			st = sidecarSt;
+			encodingIndex = sidecarIndex;
+			#if FILE_CACHE_ENTRIES > 0
+			// a sidecar file and a variant compressed on the fly alike are cached under the
+			// variant key of the original, never under the name of a file that may not exist
+			sidecarKeyLength = sidecarKey(sidecarKeyBuf, sizeof(sidecarKeyBuf), fileName, cacheKeyLength, sidecarIndex);
+			if (sidecarKeyLength >= 0)
+				entry = fileCachePut(sidecarKeyBuf, sidecarKeyLength, fd, &st, contentType, 0, encodingIndex);
+			if (entry != null)
+				fd = entry->fd;
+			#endif
+		}
+	}
 
 _sendFile200:
 
@@ -550,109 +1081,180 @@ _sendFile200:
 	Log(socket, "%15s  000  \"OPEN %s\"", client, fileName);
 	#endif
 	statusCode = HTTP_200;
+	contentLength = st.st_size;
 
-_sendFile:
+	// Validators and ranges apply to regular files only, not to generated ones
+	if (file == null) {
+		char* ifNoneMatch = requestHeaderIndex.value[HEADER_IF_NONE_MATCH];
+		char* ifModifiedSince = requestHeaderIndex.value[HEADER_IF_MODIFIED_SINCE];
+		time_t since;
+		if (addETag(&etagMemPool, &st))
+			goto _sendError500;
+		// If-None-Match takes precedence over If-Modified-Since
+		if (ifNoneMatch != null ? etagListMatches(ifNoneMatch, etagBuf, etagMemPool.current) :
+				ifModifiedSince != null && !httpDateParse(ifModifiedSince, &since) && st.st_mtime <= since) {
+			#if LOG_LEVEL > 3
+			Log(socket, "%15s  304  \"%s\"", client, fileName);
+			#endif
+			statusCode = HTTP_304;
+			if (addValidatorHeader(&extraHeaderMemPool, &st))
+				goto _sendError500;
+			goto _sendEmptyResponse;
+		}
+	}
+	if (file == null && requestHeaderIndex.value[HEADER_RANGE] != null && (requestHeaderIndex.value[HEADER_IF_RANGE] == null ||
+			ifRangeMatches(requestHeaderIndex.value[HEADER_IF_RANGE], etagBuf, etagMemPool.current, st.st_mtime))) {
+		statusCode = rangeParse(requestHeaderIndex.value[HEADER_RANGE], st.st_size, &rangeOffset, &contentLength);
+		if (statusCode != HTTP_200 && (
+			memPoolAppendLiteral(&extraHeaderMemPool, "Content-Range: bytes ") ||
+			(statusCode == HTTP_206 ? (
+				memPoolAppendNumber(&extraHeaderMemPool, rangeOffset) ||
+				memPoolAppendLiteral(&extraHeaderMemPool, "-") ||
+				memPoolAppendNumber(&extraHeaderMemPool, rangeOffset + contentLength - 1)
+			) : memPoolAppendLiteral(&extraHeaderMemPool, "*")) ||
+			memPoolAppendLiteral(&extraHeaderMemPool, "/") ||
+			memPoolAppendNumber(&extraHeaderMemPool, st.st_size) ||
+			memPoolAppendLiteral(&extraHeaderMemPool, "\r\n")
+		))
+			goto _sendError500;
+		if (statusCode == HTTP_416) {
+			#if LOG_LEVEL > 2
+			Log(socket, "%15s  416  \"RANGE %s\"", client, requestHeaderIndex.value[HEADER_RANGE]);
+			#endif
+			goto _sendEmptyResponse;
+		}
+	}
+
+	#if FILE_CACHE_SMALL_FILE > 0
+	if (entry != null && entry->response != null && statusCode == HTTP_200) {
+		// Small file kept in memory: status line, header and body go out in one system call
+		const Slice* prefix = &replyPrefix200[strcmp(protocol, PROTOCOL_HTTP_1_0) != 0][connectionState];
+		struct iovec iov[2];
+		iov[0].iov_base = (void*) prefix->text;
+		iov[0].iov_len = prefix->length;
+		iov[1].iov_base = entry->response;
+		iov[1].iov_len = entry->responseHeaderLength + (httpMethod == HTTP_HEAD ? 0 : entry->size);
+		if ((sent = sendVector(socket, iov, 2, sendFlags)) < 0)
+			connectionState = CONNECTION_CLOSE;
+		goto _return;
+	}
+	#endif
 
-	contentLength = (unsigned) st.st_size;
-	stringPoolReset(&replyHeaderPool);
+	memPoolReset(&replyHeaderMemPool);
 	if (
-		stringPoolAdd(&replyHeaderPool, protocol) ||
-		memPoolExtendChar(&replyHeaderMemPool, ' ') ||
-		memPoolExtend(&replyHeaderMemPool, httpCodeString[statusCode]) ||
-		stringPoolAdd(&replyHeaderPool, "Server: " SERVER_SOFTWARE "\r") ||
-		stringPoolAdd(&replyHeaderPool, "Content-Length: ") ||
-		memPoolExtendNumber(&replyHeaderMemPool, contentLength) ||
-		memPoolExtendChar(&replyHeaderMemPool, '\r') ||
-		stringPoolAdd(&replyHeaderPool, "Content-Type: ") ||
-		memPoolExtend(&replyHeaderMemPool, contentType) ||
-		memPoolExtendChar(&replyHeaderMemPool, '\r') ||
-		#ifdef PRAGMA
-		stringPoolAdd(&replyHeaderPool, "Pragma: " PRAGMA "\r") ||
+		memPoolAppend(&replyHeaderMemPool, protocol, strlen(protocol)) ||
+		memPoolAppendSlice(&replyHeaderMemPool, httpStatusLine[statusCode]) ||
+		#if FILE_CACHE_ENTRIES > 0
+		(entry != null && statusCode == HTTP_200 ? memPoolAppend(&replyHeaderMemPool, entry->header, entry->headerLength) :
+		#endif
+		(file == null ? addFileHeader(&replyHeaderMemPool, contentLength, &st, contentType, encodingIndex) : (
+			addEntityHeader(&replyHeaderMemPool, contentLength, contentType) ||
+			addEncodingHeader(&replyHeaderMemPool, contentType, encodingIndex)
+		))
+		#if FILE_CACHE_ENTRIES > 0
+		)
 		#endif
-		(sendWwwAuthenticate && stringPoolAdd(&replyHeaderPool, "WWW-Authenticate: Basic realm=\"Realm\"\r")) ||
-		stringPoolAdd(&replyHeaderPool, connectionString[connectionState]) ||
-		stringPoolAdd(&replyHeaderPool, "\r")
+		||
+		(file == null && memPoolAppendLiteral(&replyHeaderMemPool, "Accept-Ranges: bytes\r\n")) ||
+		memPoolAppend(&replyHeaderMemPool, extraHeaderBuf, extraHeaderMemPool.current) ||
+		(sendWwwAuthenticate && memPoolAppendLiteral(&replyHeaderMemPool, "WWW-Authenticate: Basic realm=\"Realm\"\r\n")) ||
+		memPoolAppendSlice(&replyHeaderMemPool, connectionLine[connectionState]) ||
+		memPoolAppendLiteral(&replyHeaderMemPool, "\r\n")
 	) {
 		#if LOG_LEVEL > 0
 		Log(socket, "Memory Error preparing response header");
 		#endif
 		statusCode = HTTP_500;
+		memPoolReset(&extraHeaderMemPool);
 		goto _sendEmptyResponse;
 	}
-	memPoolReplace(&replyHeaderMemPool, '\0', '\n');
-		
-	#ifdef TCP_CORK // Linux specific
-	int option = 1;
-	setsockopt(socket, SOL_TCP, TCP_CORK, &option, sizeof(option));
+
+	if (httpMethod == HTTP_HEAD || contentLength == 0) {
+		if ((sent = sendMemPool(socket, &replyHeaderMemPool, sendFlags)) < 0)
+			connectionState = CONNECTION_CLOSE;
+	}
+	#if FILE_CACHE_SMALL_FILE > 0
+	else if (entry != null && entry->response != null) {
+		// part of a small file kept in memory
+		struct iovec iov[2];
+		iov[0].iov_base = replyHeaderBuf;
+		iov[0].iov_len = replyHeaderMemPool.current;
+		iov[1].iov_base = entry->response + entry->responseHeaderLength + rangeOffset;
+		iov[1].iov_len = contentLength;
+		if ((sent = sendVector(socket, iov, 2, sendFlags)) < 0)
+			connectionState = CONNECTION_CLOSE;
+	}
 	#endif
-	
-	if (sendMemPool(socket, &replyHeaderMemPool) < 0 || (httpMethod != HTTP_HEAD && sendFile(socket, fd, contentLength) < 0))
+	else if ((sent = sendMemPool(socket, &replyHeaderMemPool, MSG_MORE)) < 0 || sendFile(socket, fd, rangeOffset, contentLength) < 0) // header and file share the first segment
 		connectionState = CONNECTION_CLOSE;
-	
-	#ifdef TCP_CORK // Linux specific
-	option = 0;
-	setsockopt(socket, SOL_TCP, TCP_CORK, &option, sizeof(option));
-	#endif
+	else {
+		sent += contentLength;
+		#ifdef METRICS_PATH
+		fileSent = contentLength;
+		#endif
+	}
 
 	goto _return;
 
 _sendError500:
 
 	statusCode = HTTP_500;
+	memPoolReset(&extraHeaderMemPool);
 
 _sendError:
 
-	connectionState = CONNECTION_CLOSE;
+	// keep the connection only if the request has been consumed completely
+	if ((statusCode != HTTP_401 && statusCode != HTTP_403 && statusCode != HTTP_404) || httpMethod == HTTP_PUT || httpMethod == HTTP_POST)
+		connectionState = CONNECTION_CLOSE;
 
 	#ifdef PRIVATE_DIR
-	fileName = (char*) (httpFile[statusCode]);
-	contentType = "text/html";
-	if (stat(fileName, &st) < 0) {
-		#if LOG_LEVEL > 0
-		Log(socket, "Server Doc Stat Error \"STAT %s\"", fileName);
-		#endif
-		goto _sendEmptyResponse;
-	}
-	else if ((fd = open(fileName, O_RDONLY)) < 0) {
-		#if LOG_LEVEL > 0
-		Log(socket, "Server Doc Open Error  \"OPEN %s\"", fileName);
-		#endif
-		goto _sendEmptyResponse;
-	}
-	
-	goto _sendFile; // send the standard error file
+	// send the pre-rendered standard error reply
+	if ((sent = errorPageSend(socket, protocol, statusCode, connectionState, httpMethod == HTTP_HEAD, connectionState == CONNECTION_KEEPALIVE ? sendFlags : 0)) < 0)
+		connectionState = CONNECTION_CLOSE;
+	goto _return;
 	#endif
 
 	// fall through if PRIVATE_DIR is not defined
 	
 _sendEmptyResponse:
 
-	stringPoolReset(&replyHeaderPool);
+	memPoolReset(&replyHeaderMemPool);
 	if (
-		stringPoolAdd(&replyHeaderPool, protocol) ||
-		memPoolExtendChar(&replyHeaderMemPool, ' ') ||
-		memPoolExtend(&replyHeaderMemPool, httpCodeString[statusCode]) ||
-		stringPoolAdd(&replyHeaderPool, "Server: " SERVER_SOFTWARE "\r") ||
-		stringPoolAdd(&replyHeaderPool, "Content-Length: 0\r") ||
+		memPoolAppend(&replyHeaderMemPool, protocol, strlen(protocol)) ||
+		memPoolAppendSlice(&replyHeaderMemPool, httpStatusLine[statusCode]) ||
+		memPoolAppendLiteral(&replyHeaderMemPool, "Server: " SERVER_SOFTWARE "\r\n") ||
+		(statusCode != HTTP_304 && memPoolAppendLiteral(&replyHeaderMemPool, "Content-Length: 0\r\n")) || // a 304 reply stands in for the headers of the file
 		#ifdef PRAGMA
-		stringPoolAdd(&replyHeaderPool, "Pragma: " PRAGMA "\r") ||
+		memPoolAppendLiteral(&replyHeaderMemPool, "Pragma: " PRAGMA "\r\n") ||
 		#endif
-		(sendWwwAuthenticate && stringPoolAdd(&replyHeaderPool, "WWW-Authenticate: Basic realm=\"Realm\"\r")) ||
-		stringPoolAdd(&replyHeaderPool, connectionString[connectionState]) ||
-		stringPoolAdd(&replyHeaderPool, "\r") 
+		memPoolAppend(&replyHeaderMemPool, extraHeaderBuf, extraHeaderMemPool.current) ||
+		(sendWwwAuthenticate && memPoolAppendLiteral(&replyHeaderMemPool, "WWW-Authenticate: Basic realm=\"Realm\"\r\n")) ||
+		memPoolAppendSlice(&replyHeaderMemPool, connectionLine[connectionState]) ||
+		memPoolAppendLiteral(&replyHeaderMemPool, "\r\n")
 	) {
 		#if LOG_LEVEL > 0
 		Log(socket, "Memory Error preparing empty response");
 		#endif
 		return CONNECTION_CLOSE;
 	}
-	memPoolReplace(&replyHeaderMemPool, '\0', '\n');
-		
-	if (sendMemPool(socket, &replyHeaderMemPool) < 0)
+
+	if ((sent = sendMemPool(socket, &replyHeaderMemPool, connectionState == CONNECTION_KEEPALIVE ? sendFlags : 0)) < 0)
 		connectionState = CONNECTION_CLOSE;
 
 _return:
 
+	#ifdef ACCESS_LOG_FILE
+	accessLogWrite(&requestStart, sa.sin_addr.s_addr, atoi(httpStatusLine[statusCode].text + 1), httpMethod, sent < 0 ? 0 : sent, resource);
+	#endif
+	#ifdef METRICS_PATH
+	metricsRequest(httpMethod, statusCode, sent, fileSent, connectionState);
+	#endif
+
+	#if FILE_CACHE_ENTRIES > 0
+	if (entry != null)
+		fileCacheRelease(entry);
+	else
+	#endif
 	if (file != null) {
 		rc = fclose(file);
 		#if LOG_LEVEL > 3
@@ -668,3 +1270,37 @@ _return:
 	return connectionState;
 
 }
+
+// Reject a connection without reading the request, typically because
+// the server is overloaded. The reply must not stall the caller, hence
+// the socket is switched to non-blocking mode. The end of the reply is
+// signalled right away; the caller reads and discards the request before
+// closing the socket, see lingerAdd().
+
+void httpServiceUnavailable(const int socket) {
+
+	#if LOG_LEVEL > 0
+	struct sockaddr_in sa;
+	int addressLength = sizeof(struct sockaddr_in);
+	getpeername(socket, (struct sockaddr*)&sa, (socklen_t*) &addressLength);
+	char client[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &sa.sin_addr, client, INET_ADDRSTRLEN);
+	Log(socket, "%15s  503  \"Server overloaded\"", client);
+	#endif
+
+	fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+
+	#ifdef PRIVATE_DIR
+	errorPageSend(socket, PROTOCOL_HTTP_1_1, HTTP_503, CONNECTION_CLOSE, false, 0);
+	#else
+	static const char reply[] = PROTOCOL_HTTP_1_1 " 503 Service Unavailable\r\nServer: " SERVER_SOFTWARE "\r\nContent-Length: 0\r\n"
+		#ifdef PRAGMA
+		"Pragma: " PRAGMA "\r\n"
+		#endif
+		"Connection: close\r\n\r\n";
+	sendBuffer(socket, reply, sizeof(reply) - 1);
+	#endif
+
+	shutdown(socket, SHUT_WR);
+
+}
@@ -0,0 +1,307 @@
+/*
+
+mrhttpd v2.8.0
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include "mrhttpd.h"
+
+#if CGI_WORKERS > 0
+
+// Persistent CGI workers
+
+// Instead of starting a process per request, the server keeps up to
+// CGI_WORKERS worker processes per script. A worker is started on demand,
+// with one end of a socketpair as its stdin and stdout, and serves one
+// request after the other:
+//
+// - The request arrives as in SCGI: a netstring of the CGI variables, each
+//   name and value terminated by a NUL byte, starting with CONTENT_LENGTH,
+//   followed by as many bytes of request body.
+// - The worker writes its output, i.e. the CGI header and the body, as a
+//   sequence of netstrings, e.g. "6:hello\n,". An empty netstring "0:," ends
+//   the reply.
+//
+// A worker that fails or breaks the protocol is killed, and its slot is
+// free for a new worker. So is a worker whose script has been modified since
+// it was started, once it is idle. If a worker turns out to be dead before it
+// has sent anything, the request is repeated with another worker.
+//
+// Workers are kept for up to SCGI_SCRIPTS scripts. If another script is
+// requested, the least recently used script without busy workers gives up
+// its slot, and its workers are killed. If all scripts are busy, the request
+// waits for one of them to become idle.
+
+#define SCGI_SCRIPTS 16 // scripts with workers
+
+typedef struct {
+	pid_t pid;                // 0 if the slot is free
+	int fd;                   // server end of the socketpair
+	boolean busy;
+	boolean retire;           // kill once idle, the script has been modified
+} CgiWorker;
+
+typedef struct {
+	char name[256];           // file name of the script, empty if the slot is free
+	time_t modified;          // of the script when the workers were started
+	unsigned long used;       // value of scgiClock when last acquired
+	CgiWorker worker[CGI_WORKERS];
+} CgiScript;
+
+CgiScript scgiScript[SCGI_SCRIPTS];
+unsigned long scgiClock = 0;
+pthread_mutex_t scgiMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scgiIdle = PTHREAD_COND_INITIALIZER;
+
+// Start a worker process. Caller holds scgiMutex.
+
+boolean scgiSpawn(CgiWorker* worker, const char* fileName) {
+	char* argv[] = { (char*) fileName, null };
+	char* env[] = { "GATEWAY_INTERFACE=CGI/1.1", "SERVER_SOFTWARE=" SERVER_SOFTWARE, null };
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+		return true;
+	pid = spawnProcess(fileName, argv, env, CGI_DIR, sv[1], sv[1]);
+	close(sv[1]);
+	if (pid == -1) {
+		close(sv[0]);
+		return true;
+	}
+	reaperAdd(pid);
+	setTimeout(sv[0]);
+	worker->pid = pid;
+	worker->fd = sv[0];
+	worker->retire = false;
+	return false;
+}
+
+// Kill a worker and free its slot. Caller holds scgiMutex.
+// The process is reaped by the reaper thread.
+
+void scgiKill(CgiWorker* worker) {
+	kill(worker->pid, SIGKILL);
+	close(worker->fd);
+	worker->pid = 0;
+	worker->busy = false;
+}
+
+// The slot of a script, taken from the least recently used script without
+// busy workers if need be. Returns null if all scripts are busy. Caller holds
+// scgiMutex.
+
+CgiScript* scgiScriptSlot(const char* fileName, const time_t modified) {
+	CgiScript* script = null;
+	int i, j;
+
+	for (i = 0; i < SCGI_SCRIPTS; i++)
+		if (!strcmp(scgiScript[i].name, fileName))
+			return &scgiScript[i];
+	for (i = 0; i < SCGI_SCRIPTS; i++) {
+		if (scgiScript[i].name[0] == '\0') {
+			script = &scgiScript[i];
+			break; // free slot
+		}
+		for (j = 0; j < CGI_WORKERS && !scgiScript[i].worker[j].busy; j++)
+			;
+		if (j == CGI_WORKERS && (script == null || scgiScript[i].used < script->used))
+			script = &scgiScript[i];
+	}
+	if (script == null)
+		return null;
+	for (j = 0; j < CGI_WORKERS; j++)
+		if (script->worker[j].pid != 0)
+			scgiKill(&script->worker[j]);
+	strcpy(script->name, fileName);
+	script->modified = modified;
+	return script;
+}
+
+// An idle worker of the script, started if need be. Waits for a worker to
+// become idle if all CGI_WORKERS are busy, or for a script slot if all
+// scripts are busy. Returns null on error or timeout.
+
+CgiWorker* scgiAcquire(const char* fileName, const time_t modified, boolean* fresh) {
+	CgiScript* script = null;
+	CgiWorker* worker = null;
+	struct timespec deadline;
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += RECEIVE_TIMEOUT;
+	if (strlen(fileName) >= sizeof(script->name))
+		return null;
+	pthread_mutex_lock(&scgiMutex);
+	while ((script = scgiScriptSlot(fileName, modified)) == null)
+		if (pthread_cond_timedwait(&scgiIdle, &scgiMutex, &deadline))
+			goto _unlock; // all scripts busy
+	script->used = ++scgiClock;
+
+	if (script->modified != modified) {
+		// replace the workers of the old script
+		script->modified = modified;
+		for (i = 0; i < CGI_WORKERS; i++)
+			if (script->worker[i].pid != 0) {
+				if (script->worker[i].busy)
+					script->worker[i].retire = true;
+				else
+					scgiKill(&script->worker[i]);
+			}
+	}
+
+	for (;;) {
+		for (i = 0; i < CGI_WORKERS; i++)
+			if (script->worker[i].pid != 0 && !script->worker[i].busy) {
+				worker = &script->worker[i];
+				*fresh = false;
+				goto _found;
+			}
+		for (i = 0; i < CGI_WORKERS; i++)
+			if (script->worker[i].pid == 0) {
+				worker = &script->worker[i];
+				*fresh = true;
+				if (scgiSpawn(worker, fileName))
+					worker = null;
+				goto _found;
+			}
+		if (pthread_cond_timedwait(&scgiIdle, &scgiMutex, &deadline))
+			goto _unlock;
+	}
+
+_found:
+	if (worker != null)
+		worker->busy = true;
+_unlock:
+	pthread_mutex_unlock(&scgiMutex);
+	return worker;
+}
+
+// Hand back a worker after a request; it is killed unless the request was successful
+
+void scgiRelease(CgiWorker* worker, const boolean success) {
+	pthread_mutex_lock(&scgiMutex);
+	if (success && !worker->retire)
+		worker->busy = false;
+	else
+		scgiKill(worker);
+	pthread_cond_broadcast(&scgiIdle); // a slot may be free for another script's waiter, too
+	pthread_mutex_unlock(&scgiMutex);
+}
+
+// The request: a netstring of NUL terminated names and values
+
+boolean scgiRequestEncode(MemPool* mp, const StringPool* env, const off_t length) {
+	char headerBuf[HTTP_HEADER_LENGTH + 1024];
+	MemPool headers = { sizeof(headerBuf), 0, headerBuf };
+	const char* variable, *value;
+	int i;
+
+	// CONTENT_LENGTH must come first
+	if (
+		memPoolAppend(&headers, "CONTENT_LENGTH", 15) ||
+		memPoolAppendNumber(&headers, length) ||
+		memPoolAppend(&headers, "\0" "SCGI\0" "1\0", 8)
+	)
+		return true;
+	for (i = 0; i < env->current; i++) {
+		variable = env->strings[i];
+		if ((value = strchr(variable, '=')) == null || !strncmp(variable, "CONTENT_LENGTH=", 15))
+			continue;
+		if (
+			memPoolAppend(&headers, variable, value - variable) ||
+			memPoolAppend(&headers, "", 1) ||
+			memPoolAppend(&headers, value + 1, strlen(value)) // including the NUL
+		)
+			return true;
+	}
+	return
+		memPoolAppendNumber(mp, headers.current) ||
+		memPoolAppendLiteral(mp, ":") ||
+		memPoolAppend(mp, headerBuf, headers.current) ||
+		memPoolAppendLiteral(mp, ",");
+}
+
+// Relay the netstrings of the worker until the empty one. Returns 0 on
+// success, 1 if the worker failed before sending anything, and -1 on any
+// other error.
+
+int scgiRelay(CgiStream* stream, CgiReply* reply) {
+	boolean received = false;
+	int length, n;
+	char c;
+
+	for (;;) {
+		length = 0;
+		for (;;) {
+			if (cgiStreamFill(stream, 1))
+				return received ? -1 : 1;
+			received = true;
+			c = stream->data[stream->start++];
+			if (c == ':')
+				break;
+			if (!isdigit(c) || length > 100000000)
+				return -1;
+			length = length * 10 + c - '0';
+		}
+		if (length == 0)
+			return cgiStreamFill(stream, 1) || stream->data[stream->start++] != ',' ? -1 : 0;
+		while (length > 0) {
+			if (cgiStreamFill(stream, 1))
+				return -1;
+			n = stream->end - stream->start;
+			if (n > length)
+				n = length;
+			// more output follows right away if there is more than the final comma
+			if (cgiReplyData(reply, stream->data + stream->start, n, stream->end - stream->start > n + 1))
+				return -1;
+			stream->start += n;
+			length -= n;
+		}
+		if (cgiStreamFill(stream, 1) || stream->data[stream->start++] != ',')
+			return -1;
+	}
+}
+
+// Pass a CGI request to a worker of the script and relay its reply to the
+// client. Returns true on error; the reply is incomplete then, or, if
+// reply->sent is still 0, the client has not received anything yet.
+
+boolean scgiRequest(const char* fileName, const time_t modified, const StringPool* env, CgiBody* body, CgiReply* reply) {
+	char requestBuf[HTTP_HEADER_LENGTH + 1280];
+	MemPool request = { sizeof(requestBuf), 0, requestBuf };
+	CgiStream stream;
+	CgiWorker* worker;
+	const off_t length = body->remaining;
+	boolean fresh;
+	int rc;
+
+	if (scgiRequestEncode(&request, env, length))
+		return true;
+	do {
+		if ((worker = scgiAcquire(fileName, modified, &fresh)) == null)
+			return true;
+		stream.fd = worker->fd;
+		stream.start = stream.end = 0;
+		rc = cgiWrite(stream.fd, requestBuf, request.current) ? 1 : cgiBodyWrite(body, stream.fd) ? -1 : scgiRelay(&stream, reply);
+		scgiRelease(worker, rc == 0);
+	} while (rc == 1 && !fresh && body->remaining == length); // the worker may have died while idle, retry unless the body is gone
+	return rc != 0 || cgiReplyEnd(reply);
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+
+mrhttpd v2.8.0
+Copyright (c) 2007-2021  Martin Rogge <martin_rogge@users.sourceforge.net>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation, version 2.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include "mrhttpd.h"
+
+#if defined(CGI_PATH) || defined(EXT_FILE_CMD)
+
+// Child processes
+
+// Programs are started via posix_spawn(), which glibc implements with
+// clone(CLONE_VM | CLONE_VFORK): the child borrows the address space of the
+// server until it calls execve(), so nothing is copied, and the child runs no
+// code of the server that might wait for a lock held by another thread.
+// File actions connect stdin and stdout and close all other descriptors,
+// in particular the sockets of other clients. SIGPIPE, which the server
+// ignores, is reset to its default.
+
+pid_t spawnProcess(const char* path, char* const argv[], char* const env[], const char* dir, const int in, const int out) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t defaults;
+	pid_t pid;
+	int rc;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attr);
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+	rc =
+		(in >= 0 ? posix_spawn_file_actions_adddup2(&actions, in, 0) : posix_spawn_file_actions_addclose(&actions, 0)) ||
+		posix_spawn_file_actions_adddup2(&actions, out, 1) ||
+		(dir != null && posix_spawn_file_actions_addchdir_np(&actions, dir)) ||
+		posix_spawn_file_actions_addclosefrom_np(&actions, 2) ||
+		posix_spawn(&pid, path, &actions, &attr, argv, env);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	return rc ? -1 : pid;
+}
+
+#endif
+
+#ifdef CGI_PATH
+
+// The server does not wait for its CGI programs. Instead, a reaper thread
+// watches the pidfds of the children in an epoll set and collects the exit
+// status of each child as soon as it has exited.
+
+int reaperFd = -1;
+
+void* reaperThread(void* arg) {
+	struct epoll_event event[16];
+	siginfo_t info;
+	int i, count;
+
+	for (;;) {
+		count = epoll_wait(reaperFd, event, sizeof(event) / sizeof(event[0]), -1);
+		for (i = 0; i < count; i++) {
+			info.si_pid = 0;
+			if (waitid(P_PIDFD, event[i].data.fd, &info, WEXITED | WNOHANG) == 0 && info.si_pid == 0)
+				continue; // not quite a zombie yet, the event recurs
+			// a child being spawned may hold a copy of the pidfd, closing it is not enough
+			epoll_ctl(reaperFd, EPOLL_CTL_DEL, event[i].data.fd, null);
+			close(event[i].data.fd);
+		}
+	}
+	return null;
+}
+
+boolean reaperInit(void) {
+	pthread_t threadId;
+
+	reaperFd = epoll_create1(EPOLL_CLOEXEC);
+	return reaperFd >= 0 && !pthread_create(&threadId, null, reaperThread, null);
+}
+
+// Have a child process reaped by the reaper thread once it exits
+
+void reaperAdd(const pid_t pid) {
+	struct epoll_event event;
+	int fd = pidfd_open(pid, 0);
+
+	if (fd < 0)
+		return; // the child will remain a zombie
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(reaperFd, EPOLL_CTL_ADD, fd, &event))
+		close(fd);
+}
+
+#endif
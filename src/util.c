@@ -47,6 +47,20 @@ char* startOf(char* string) {
 	return string;
 }
 
+// Parse an HTTP date as per RFC 1123. The obsolete formats are not supported.
+
+boolean httpDateParse(const char* string, time_t* t) {
+	struct tm tm;
+	char* end;
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(string, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (end == null)
+		return true; // not a date
+	*t = timegm(&tm);
+	return false; // success
+}
+
 // Formatted file output
 
 #if (LOG_LEVEL > 0) || (DEBUG > 0) || (AUTO_INDEX > 0)
@@ -165,146 +179,549 @@ boolean fileNameEncode(const char* in, char* out, size_t outLength) {
 
 // mime type detection based on suffix is a light-weight alternative to file(1)
 
-const char* mimeType(const char* fileName) {
+// The suffixes are kept in a hash table with open addressing, built at start-up
+// from the table below and, optionally, from MIME_TYPES_FILE. Suffixes are
+// matched case-insensitively, so "photo.JPG" is an image/jpeg, too.
 
-	static const char* (assocNames[][2]) = {
+const char* (assocNames[][2]) = {
 
 /* the mime types for web content should always be present */
 
-		{ "html",  "text/html" },
-		{ "htm",   "text/html" },
-		{ "txt",   "text/plain" },
-		{ "css",   "text/css" },
-		{ "png",   "image/png" },
-		{ "gif",   "image/gif" },
-		{ "jpg",   "image/jpeg" },
-		{ "jpeg",  "image/jpeg" },
-		{ "ico",   "image/vnd.microsoft.icon" },
-		{ "js",    "application/x-javascript" },
-		
+	{ "html",  "text/html" },
+	{ "htm",   "text/html" },
+	{ "txt",   "text/plain" },
+	{ "css",   "text/css" },
+	{ "png",   "image/png" },
+	{ "gif",   "image/gif" },
+	{ "jpg",   "image/jpeg" },
+	{ "jpeg",  "image/jpeg" },
+	{ "ico",   "image/vnd.microsoft.icon" },
+	{ "js",    "application/x-javascript" },
+	
 /* the following can be modified as required */
 
-		{ "yml",   "text/yaml" },
-		{ "yaml",  "text/yaml" },
-		{ "md",    "text/markdown" },
-		{ "bmp",   "image/bmp" },
-		{ "mp3",   "audio/mpeg" },
-		{ "mp2",   "audio/mpeg" },
-		{ "mpga",  "audio/mpeg" },
-		{ "wav",   "audio/x-wav" },
-		{ "mid",   "audio/midi" },
-		{ "midi",  "audio/midi" },
-		{ "mpeg",  "video/mpeg" },
-		{ "mpg",   "video/mpeg" },
-		{ "mp4",   "video/mp4" },
-		{ "3gp",   "video/3gpp" },
-		{ "mov",   "video/quicktime" },
-		{ "wmv",   "video/x-ms-wmv" },
-		{ "avi",   "video/x-msvideo" },
-		{ "json",  "application/json" },
-		{ "xml",   "application/xml" },
-		{ "xsl",   "application/xml" },
-		{ "xslt",  "application/xslt-xml" },
-		{ "xhtml", "application/xhtml+xml" },
-		{ "xht",   "application/xhtml+xml" },
-		{ "dtd",   "application/xml-dtd" },
-		{ "tar",   "application/x-tar" },
-		{ "zip",   "application/x-zip" },
-		
+	{ "yml",   "text/yaml" },
+	{ "yaml",  "text/yaml" },
+	{ "md",    "text/markdown" },
+	{ "bmp",   "image/bmp" },
+	{ "mp3",   "audio/mpeg" },
+	{ "mp2",   "audio/mpeg" },
+	{ "mpga",  "audio/mpeg" },
+	{ "wav",   "audio/x-wav" },
+	{ "mid",   "audio/midi" },
+	{ "midi",  "audio/midi" },
+	{ "mpeg",  "video/mpeg" },
+	{ "mpg",   "video/mpeg" },
+	{ "mp4",   "video/mp4" },
+	{ "3gp",   "video/3gpp" },
+	{ "mov",   "video/quicktime" },
+	{ "wmv",   "video/x-ms-wmv" },
+	{ "avi",   "video/x-msvideo" },
+	{ "json",  "application/json" },
+	{ "xml",   "application/xml" },
+	{ "xsl",   "application/xml" },
+	{ "xslt",  "application/xslt-xml" },
+	{ "xhtml", "application/xhtml+xml" },
+	{ "xht",   "application/xhtml+xml" },
+	{ "dtd",   "application/xml-dtd" },
+	{ "tar",   "application/x-tar" },
+	{ "zip",   "application/x-zip" },
+	
 /* the null string must be the last entry */
 
-		{ null,   null }
-	};
+	{ null,   null }
+};
+
+const char* mimeDefault = "application/octet-stream";
+
+#define MIME_SUFFIX_LENGTH 16   // including the terminating null
+#define MIME_TABLE_SIZE    4096 // a power of two, well above the number of suffixes (/etc/mime.types has 1500)
+
+typedef struct {
+	char suffix[MIME_SUFFIX_LENGTH]; // lower case, empty if the slot is free
+	const char* type;
+} MimeEntry;
+
+MimeEntry mimeTable[MIME_TABLE_SIZE];
+
+// Copy a suffix in lower case and hash it. Returns true if the suffix is too long.
+
+boolean mimeSuffix(const char* suffix, const int length, char* lower, unsigned* hash) {
+	int i;
+
+	if (length >= MIME_SUFFIX_LENGTH)
+		return true;
+	*hash = 2166136261u; // FNV-1a
+	for (i = 0; i < length; i++) {
+		lower[i] = tolower((unsigned char) suffix[i]);
+		*hash = (*hash ^ (unsigned char) lower[i]) * 16777619u;
+	}
+	lower[length] = '\0';
+	return false;
+}
+
+// Add a suffix to the table. A later entry for the same suffix takes precedence.
+
+void mimeTypeAdd(const char* suffix, const int length, const char* type) {
+	char lower[MIME_SUFFIX_LENGTH];
+	unsigned hash, i;
+	MimeEntry* entry;
+
+	if (length == 0 || mimeSuffix(suffix, length, lower, &hash))
+		return;
+	for (i = 0; i < MIME_TABLE_SIZE; i++) {
+		entry = &mimeTable[(hash + i) & (MIME_TABLE_SIZE - 1)];
+		if (entry->suffix[0] == '\0' || !strcmp(entry->suffix, lower)) {
+			memcpy(entry->suffix, lower, length + 1);
+			entry->type = type;
+			return;
+		}
+	}
+	// table full, the suffix is ignored
+}
+
+#ifdef MIME_TYPES_FILE
 
-	static const char* mimeDefault = "application/octet-stream";
+// Read a file in the format of /etc/mime.types: a mime type followed
+// by its suffixes, separated by white space. '#' starts a comment.
 
-	const char* ((*anp)[2]) = null;
+boolean mimeTypesRead(const char* fileName) {
+	char line[1024];
+	char* type;
 	char* suffix;
+	char* next;
+	FILE* file;
+
+	file = fopen(fileName, "r");
+	if (file == null)
+		return false;
+	while (fgets(line, sizeof(line), file) != null) {
+		if ((next = strchr(line, '#')) != null)
+			*next = '\0';
+		type = strtok_r(line, " \t\r\n", &next);
+		if (type == null || (suffix = strtok_r(null, " \t\r\n", &next)) == null)
+			continue; // empty line, or a type without suffixes
+		type = strdup(type); // kept for the lifetime of the server
+		if (type == null)
+			break;
+		for (; suffix != null; suffix = strtok_r(null, " \t\r\n", &next))
+			mimeTypeAdd(suffix, strlen(suffix), type);
+	}
+	fclose(file);
+	return true;
+}
+
+#endif
+
+// Build the suffix table. Returns false if MIME_TYPES_FILE cannot be read.
+
+boolean mimeTypesInit(void) {
+	const char* ((*anp)[2]);
+
+	for (anp = assocNames; (*anp)[0] != null; anp++)
+		mimeTypeAdd((*anp)[0], strlen((*anp)[0]), (*anp)[1]);
+	#ifdef MIME_TYPES_FILE
+	return mimeTypesRead(MIME_TYPES_FILE);
+	#else
+	return true;
+	#endif
+}
+
+// Mime type by suffix, or null if the suffix is unknown
+
+const char* mimeTypeBySuffix(const char* fileName) {
+	char lower[MIME_SUFFIX_LENGTH];
+	const char* suffix;
+	MimeEntry* entry;
+	unsigned hash, i;
 
 	suffix = strrchr(fileName, '.');
-	if (suffix != null) {
-		suffix++;
-		for (anp = assocNames; (*anp)[0] != null; anp++)
-			if (!strcmp((*anp)[0], suffix)) {
-				return (*anp)[1];
-			}
+	if (suffix != null && !mimeSuffix(suffix + 1, strlen(suffix + 1), lower, &hash)) {
+		for (i = 0; i < MIME_TABLE_SIZE; i++) {
+			entry = &mimeTable[(hash + i) & (MIME_TABLE_SIZE - 1)];
+			if (entry->suffix[0] == '\0')
+				break;
+			if (!strcmp(entry->suffix, lower))
+				return entry->type;
+		}
 	}
-	// suffix not found
+	return null;
+}
+
+// Mime type by suffix only, as used for directory listings
+
+const char* mimeType(const char* fileName) {
+	const char* type = mimeTypeBySuffix(fileName);
+
+	return type != null ? type : mimeDefault;
+}
+
+// Files with an unknown suffix are identified by their first bytes. The result
+// is cached per file, identified by device, inode and modification time, so a
+// file is inspected once until it changes. Mime types are handed out as strings
+// that are never modified or freed, hence they can be used without locking.
+
+#define MIME_SNIFF_LENGTH  512
+#define MIME_SNIFF_ENTRIES 256 // direct mapped
+#define MIME_INTERNED      64  // distinct results of EXT_FILE_CMD
+
+typedef struct {
+	dev_t device;
+	ino_t inode;
+	time_t modified;
+	const char* type; // null if the slot is free
+} MimeSniffEntry;
+
+typedef struct {
+	int offset;
+	int length;
+	const char* magic;
+	const char* type;
+} MimeMagic;
+
+const MimeMagic mimeMagic[] = {
+	{ 0,   8, "\x89PNG\r\n\x1a\n",     "image/png" },
+	{ 0,   6, "GIF87a",                 "image/gif" },
+	{ 0,   6, "GIF89a",                 "image/gif" },
+	{ 0,   3, "\xff\xd8\xff",           "image/jpeg" },
+	{ 8,   4, "WEBP",                   "image/webp" },  // RIFF container
+	{ 8,   4, "WAVE",                   "audio/x-wav" },
+	{ 8,   4, "AVI ",                   "video/x-msvideo" },
+	{ 0,   4, "\0\0\1\0",               "image/vnd.microsoft.icon" },
+	{ 0,   2, "BM",                     "image/bmp" },
+	{ 0,   5, "%PDF-",                  "application/pdf" },
+	{ 0,   4, "%!PS",                   "application/postscript" },
+	{ 0,   4, "PK\3\4",                 "application/x-zip" },
+	{ 0,   2, "\x1f\x8b",               "application/gzip" },
+	{ 0,   3, "BZh",                    "application/x-bzip2" },
+	{ 0,   6, "\xfd" "7zXZ\0",          "application/x-xz" },
+	{ 0,   4, "\x28\xb5\x2f\xfd",       "application/zstd" },
+	{ 0,   6, "7z\xbc\xaf\x27\x1c",     "application/x-7z-compressed" },
+	{ 257, 5, "ustar",                  "application/x-tar" },
+	{ 0,   4, "\x7f" "ELF",             "application/x-executable" },
+	{ 0,   3, "ID3",                    "audio/mpeg" },
+	{ 0,   4, "fLaC",                   "audio/flac" },
+	{ 0,   4, "OggS",                   "application/ogg" },
+	{ 0,   4, "MThd",                   "audio/midi" },
+	{ 4,   6, "ftypqt",                 "video/quicktime" },
+	{ 4,   4, "ftyp",                   "video/mp4" },
+	{ 0,   4, "\x1a\x45\xdf\xa3",       "video/webm" },
+	{ 0,   4, "wOFF",                   "font/woff" },
+	{ 0,   4, "wOF2",                   "font/woff2" },
+	{ 0,   5, "<?xml",                  "application/xml" },
+	{ 0,   0, null,                     null }
+};
+
+MimeSniffEntry mimeSniffCache[MIME_SNIFF_ENTRIES];
+pthread_mutex_t mimeSniffMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Identify content by its first bytes, returns null if in doubt
+
+const char* mimeSniff(const unsigned char* buf, const int count) {
+	const MimeMagic* mm;
+	int i;
+
+	for (mm = mimeMagic; mm->magic != null; mm++)
+		if (mm->offset + mm->length <= count && !memcmp(buf + mm->offset, mm->magic, mm->length))
+			return mm->type;
+	for (i = 0; i < count && isspace(buf[i]); i++)
+		;
+	if ((count - i >= 14 && !strncasecmp((const char*) buf + i, "<!doctype html", 14)) || (count - i >= 5 && !strncasecmp((const char*) buf + i, "<html", 5)))
+		return "text/html";
+	if (count == 0)
+		return null;
+	for (i = 0; i < count; i++)
+		if (buf[i] < 0x20 && buf[i] != '\t' && buf[i] != '\n' && buf[i] != '\r' && buf[i] != '\f' && buf[i] != 0x1b)
+			return null; // binary
+	return "text/plain"; // ASCII or UTF-8
+}
+
+#ifdef EXT_FILE_CMD
+
+// Keep the result of the external command for good. Caller holds mimeSniffMutex.
+
+const char* mimeIntern(const char* type) {
+	static char* interned[MIME_INTERNED];
+	static int count = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (!strcmp(interned[i], type))
+			return interned[i];
+	if (count == MIME_INTERNED || (interned[count] = strdup(type)) == null)
+		return mimeDefault;
+	return interned[count++];
+}
+
+// Call the external command to determine the file type, typically "file -b --mime-type".
+// Returns the result in buf, empty if unsuccessful.
+
+void mimeExternal(const char* fileName, char* buf, const int size) {
+	int pipeFd[2];
+	ssize_t cnt = 0;
 
-	#ifdef EXT_FILE_CMD
-	// call external command to determine file type
-	// typically "file -b --mime-type"
 	#if DEBUG & 128
 	Log(0, "MT: calling external command for %s", fileName);
 	#endif
-	int pipeFd[2];
-	static char buf[64];
-	ssize_t cnt = 0;
-	
 	if (pipe(pipeFd) == 0) {
 		#if DEBUG & 128
 		Log(0, "MT: pipe created witch fd %d %d", pipeFd[0], pipeFd[1]);
 		#endif
-		if (!fork()) { 
-			// child process continues here
-			if (dup2(pipeFd[1], 1) == 1) {
-				#if DEBUG & 128
-				Log(0, "MT: child process execve \"%s -b --mime-type %s\"", EXT_FILE_CMD, fileName);
-				#endif
-				execl(EXT_FILE_CMD, EXT_FILE_CMD, "-b", "--mime-type", fileName, null); // should never return
-				#if DEBUG & 128
-				Log(0, "MT: child process returned with errno %d", errno);
-				#endif
-			}
-			exit(-1);   // some error, exit child process
-		}
-		// parent process continues here
+		char* argv[] = { EXT_FILE_CMD, "-b", "--mime-type", (char*) fileName, null };
+		pid_t childPid = spawnProcess(EXT_FILE_CMD, argv, environ, null, -1, pipeFd[1]);
+		#if DEBUG & 128
+		Log(0, "MT: spawned \"%s -b --mime-type %s\" as %d", EXT_FILE_CMD, fileName, childPid);
+		#endif
 		close(pipeFd[1]);
-		cnt = read(pipeFd[0], buf, 63);
+		if (childPid != -1) {
+			cnt = read(pipeFd[0], buf, size - 1);
+			waitpid(childPid, null, 0);
+		}
 		close(pipeFd[0]);
 		// eat trailing whitespace
 		while ((cnt > 0) && iscntrl(buf[cnt - 1]))
 			cnt--;
-		buf[cnt] = '\0';
 		#if DEBUG & 128
+		buf[cnt < 0 ? 0 : cnt] = '\0';
 		Log(0, "MT: parent process obtained \"%s\"", buf);
 		#endif
-		if (*buf)
-			return buf;
 	}
+	buf[cnt < 0 ? 0 : cnt] = '\0';
+}
+
+#endif
+
+// Mime type of an open file: by suffix, else by content, else via EXT_FILE_CMD
+
+const char* mimeTypeOfFile(const char* fileName, const int fd, const struct stat* st) {
+	unsigned char buf[MIME_SNIFF_LENGTH];
+	MimeSniffEntry* entry;
+	const char* type;
+	ssize_t count;
+
+	type = mimeTypeBySuffix(fileName);
+	if (type != null)
+		return type;
+
+	entry = &mimeSniffCache[((unsigned) st->st_ino ^ (unsigned) st->st_dev * 16777619u) % MIME_SNIFF_ENTRIES];
+	pthread_mutex_lock(&mimeSniffMutex);
+	if (entry->type != null && entry->inode == st->st_ino && entry->device == st->st_dev && entry->modified == st->st_mtime) {
+		type = entry->type;
+		pthread_mutex_unlock(&mimeSniffMutex);
+		return type;
+	}
+	pthread_mutex_unlock(&mimeSniffMutex);
+
+	count = pread(fd, buf, sizeof(buf), 0);
+	type = mimeSniff(buf, count < 0 ? 0 : count);
+	#ifdef EXT_FILE_CMD
+	char ext[64];
+	if (type == null)
+		mimeExternal(fileName, ext, sizeof(ext));
 	#endif
+
+	pthread_mutex_lock(&mimeSniffMutex);
+	#ifdef EXT_FILE_CMD
+	if (type == null && *ext)
+		type = mimeIntern(ext);
+	#endif
+	if (type == null)
+		type = mimeDefault;
+	entry->device = st->st_dev;
+	entry->inode = st->st_ino;
+	entry->modified = st->st_mtime;
+	entry->type = type;
+	pthread_mutex_unlock(&mimeSniffMutex);
 	#if DEBUG & 128
-	Log(0, "MT: returning default mime type %s", mimeDefault);
+	Log(0, "MT: %s identified as %s", fileName, type);
 	#endif
-	
-	return mimeDefault;
+	return type;
+}
+
+// Only content of these types is worth compressing
+
+boolean mimeCompressible(const char* mimeType) {
+	return !strncmp(mimeType, "text/", 5) || strstr(mimeType, "javascript") || strstr(mimeType, "json") || strstr(mimeType, "xml");
 }
 
 // Log support
 
 #if (LOG_LEVEL > 0) || (DEBUG > 0)
 
+// Log lines are formatted by the calling thread into one of LOG_RINGS ring
+// buffers and written to the log file by a dedicated writer thread, which
+// batches them into few write() calls. Threads are assigned to the rings in
+// turn and stick to theirs, so with more threads than rings a ring is shared
+// by several of them. The rings are lock-free bounded queues that tolerate
+// multiple producers and a single consumer. When a ring is full the line is
+// dropped and counted rather than blocking the caller. Lines from different
+// rings may be interleaved slightly out of order within a batch.
+
+// When all rings are empty the writer sleeps on a semaphore. It announces
+// this in logSleeping, and the next line posts the semaphore, so a busy
+// writer costs the callers no system call.
+
+#define LOG_RINGS       16
+#define LOG_RING_SIZE   512   // lines per ring, a power of two
+#define LOG_LINE_LENGTH 256   // longer lines are truncated
+
+typedef struct {
+	unsigned sequence;        // slot is free for writing when equal to the position, readable when one more
+	int length;
+	char text[LOG_LINE_LENGTH];
+} LogSlot;
+
+typedef struct {
+	unsigned head __attribute__ ((aligned (64))); // next position to write, shared by producers
+	unsigned tail __attribute__ ((aligned (64))); // next position to read, writer thread only
+	LogSlot slot[LOG_RING_SIZE];
+} LogRing;
+
+LogRing logRing[LOG_RINGS];
+unsigned logRingNext = 0;
+unsigned long logDropped = 0;
+volatile sig_atomic_t logStopping = 0;
+int logSleeping = 0;
+sem_t logWake;
+pthread_t logWriterThread;
+int logFd = -1;
 FILE* logFile;
 
-pthread_mutex_t logFileMutex = PTHREAD_MUTEX_INITIALIZER;
+// Timestamp with microseconds, the part up to the seconds is cached per thread
+
+int logTimestamp(char* buf) {
+	static __thread time_t cachedSecond = -1;
+	static __thread char cachedText[20];
+	struct timeval tv;
+	struct tm tm;
+	unsigned usec;
+	int i;
+
+	gettimeofday(&tv, NULL);
+	if (tv.tv_sec != cachedSecond) {
+		localtime_r(&tv.tv_sec, &tm);
+		strftime(cachedText, sizeof(cachedText), "%Y-%m-%d %H:%M:%S", &tm);
+		cachedSecond = tv.tv_sec;
+	}
+	memcpy(buf, cachedText, 19);
+	buf[19] = '.';
+	for (i = 25, usec = tv.tv_usec; i > 19; i--, usec /= 10)
+		buf[i] = digit[usec % 10];
+	return 26;
+}
+
+// Take the next readable slot of a ring, or null if the ring is empty
+
+LogSlot* logRingPeek(LogRing* ring) {
+	LogSlot* slot = &ring->slot[ring->tail & (LOG_RING_SIZE - 1)];
+
+	return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == ring->tail + 1 ? slot : null;
+}
+
+void logRingRelease(LogRing* ring, LogSlot* slot) {
+	__atomic_store_n(&slot->sequence, ring->tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+	ring->tail++;
+}
+
+boolean logRingsEmpty(void) {
+	int ring;
+
+	for (ring = 0; ring < LOG_RINGS; ring++)
+		if (logRingPeek(&logRing[ring]) != null)
+			return false;
+	return true;
+}
+
+void logWriteAll(const char* buf, int count) {
+	ssize_t written;
+
+	while (count > 0) {
+		written = write(logFd, buf, count);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return; // nothing sensible to do
+		}
+		buf += written;
+		count -= written;
+	}
+}
+
+void* logWriter(void* arg) {
+	char buf[65536];
+	unsigned long dropped, reported = 0;
+	boolean stopping, idle;
+	LogSlot* slot;
+	int ring, used = 0;
+
+	for (;;) {
+		stopping = logStopping; // drain once more after the flag is set
+		idle = true;
+		for (ring = 0; ring < LOG_RINGS; ring++)
+			while ((slot = logRingPeek(&logRing[ring])) != null) {
+				if (used + slot->length > (int) sizeof(buf)) {
+					logWriteAll(buf, used);
+					used = 0;
+				}
+				memcpy(buf + used, slot->text, slot->length);
+				used += slot->length;
+				logRingRelease(&logRing[ring], slot);
+				idle = false;
+			}
+		dropped = __atomic_load_n(&logDropped, __ATOMIC_RELAXED);
+		if (dropped != reported && used + LOG_LINE_LENGTH <= (int) sizeof(buf)) {
+			used += logTimestamp(buf + used);
+			used += snprintf(buf + used, LOG_LINE_LENGTH - 26, "  <%08d>  Log buffers full, %lu lines dropped\n", 0, dropped - reported);
+			reported = dropped;
+		}
+		if (used > 0) {
+			logWriteAll(buf, used);
+			used = 0;
+		}
+		if (stopping)
+			return null;
+		if (idle) {
+			__atomic_store_n(&logSleeping, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST); // pairs with the fence in Log()
+			// a line published before the announcement is found here
+			if (logRingsEmpty() && !logStopping)
+				while (sem_wait(&logWake) != 0 && errno == EINTR)
+					;
+			__atomic_store_n(&logSleeping, 0, __ATOMIC_RELAXED);
+		}
+	}
+}
 
 int LogOpen(const int socket) {
+	int ring, i;
+
 	#ifdef LOG_FILE
 	logFile = fopen(LOG_FILE, "at");
 	#else
 	logFile = stdout;
 	#endif
-	if (logFile != null)
-		Log(socket,
-			"Server started. Port: " SERVER_PORT_STR "."
-			#ifdef SYSTEM_USER
-			" User: " SYSTEM_USER "."
-			#endif
-			#ifdef SERVER_ROOT
-			" Server root: " SERVER_ROOT "."
-			#endif
-			);
-	return logFile != null;
+	if (logFile == null)
+		return false;
+	logFd = fileno(logFile);
+	if (sem_init(&logWake, 0, 0))
+		return false;
+	for (ring = 0; ring < LOG_RINGS; ring++) {
+		logRing[ring].head = logRing[ring].tail = 0;
+		for (i = 0; i < LOG_RING_SIZE; i++)
+			logRing[ring].slot[i].sequence = i;
+	}
+	if (pthread_create(&logWriterThread, null, logWriter, null) != 0)
+		return false;
+	Log(socket,
+		"Server started. Port: " SERVER_PORT_STR "."
+		#ifdef SYSTEM_USER
+		" User: " SYSTEM_USER "."
+		#endif
+		#ifdef SERVER_ROOT
+		" Server root: " SERVER_ROOT "."
+		#endif
+		);
+	return true;
 }
 
 void LogClose(const int socket) {
@@ -317,22 +734,55 @@ void LogClose(const int socket) {
 		" Server root: " SERVER_ROOT "."
 		#endif
 		);
+	logStopping = 1;
+	sem_post(&logWake);
+	pthread_join(logWriterThread, null);
 	fclose(logFile);
 }
 
 void Log(const int socket, const char* format, ...) {
+	static __thread int ringIndex = -1;
+	LogRing* ring;
+	LogSlot* slot;
+	unsigned position, sequence;
+	int length;
 	va_list ap;
-	pthread_mutex_lock(&logFileMutex);
-	fileWriteTimestampNow(logFile);
-	fileWriteString(logFile, "  <");
-	fileWriteNumberFixed(logFile, socket, 8);
-	fileWriteString(logFile, ">  ");
+
+	if (ringIndex < 0)
+		ringIndex = __atomic_fetch_add(&logRingNext, 1, __ATOMIC_RELAXED) % LOG_RINGS;
+	ring = &logRing[ringIndex];
+
+	// claim a slot
+	position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &ring->slot[position & (LOG_RING_SIZE - 1)];
+		sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if (sequence == position) {
+			if (__atomic_compare_exchange_n(&ring->head, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int) (sequence - position) < 0) {
+			__atomic_add_fetch(&logDropped, 1, __ATOMIC_RELAXED); // full
+			return;
+		} else
+			position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	}
+
+	// format the line into the slot
+	length = logTimestamp(slot->text);
+	length += snprintf(slot->text + length, LOG_LINE_LENGTH - length, "  <%08d>  ", socket);
 	va_start(ap, format);
-	vfprintf(logFile, format, ap);
+	length += vsnprintf(slot->text + length, LOG_LINE_LENGTH - length, format, ap);
 	va_end(ap);
-	fileWriteChar(logFile, '\n');
-	fflush(logFile);
-	pthread_mutex_unlock(&logFileMutex);
+	if (length > LOG_LINE_LENGTH - 1)
+		length = LOG_LINE_LENGTH - 1; // truncated
+	slot->text[length++] = '\n';
+	slot->length = length;
+	__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+
+	// wake the writer if it sleeps
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&logSleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&logSleeping, 0, __ATOMIC_RELAXED))
+		sem_post(&logWake);
 }
 
 #endif